@@ -147,6 +147,7 @@ typedef struct Arena {
 void *arena_alloc( Arena *arena, size_t size, size_t align );
 Arena new_arena( void );
 void arena_free( Arena * );
+void arena_reset( Arena * );
 int read_text_file_to_buffer( const char *path, char **buffer );
 
 
@@ -0,0 +1,231 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "common.h"
+#include "HandmadeMath.h"
+#include <float.h>
+// stb_image_write.h has to be included before this header, it can
+// only be included once in the translation unit that implements it
+
+// Linear float accumulation buffer. Samples are summed into accum and
+// only divided by the per pixel sample count when the image is
+// resolved, so any number of passes can be added on top.
+// Row 0 is the top row of the image.
+struct Framebuffer {
+  int nx, ny;
+  v3 *accum;
+  uint32 *samples;
+  float *lum_sq; // sum of the squared luminance of the samples
+  uint8 *active; // pixels that still take samples in adaptive mode
+  uint8 *image;  // 8 bit, gamma corrected
+};
+
+inline float luminance( const v3 &c ){
+  return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+Framebuffer framebuffer_create( int nx, int ny ){
+  Framebuffer fb;
+  fb.nx = nx;
+  fb.ny = ny;
+  fb.accum = ( v3 *)calloc( nx * ny, sizeof( v3 ) );
+  fb.samples = ( uint32 *)calloc( nx * ny, sizeof( uint32 ) );
+  fb.lum_sq = ( float *)calloc( nx * ny, sizeof( float ) );
+  fb.active = ( uint8 *)malloc( nx * ny * sizeof( uint8 ) );
+  fb.image = ( uint8 *)calloc( 3 * nx * ny, sizeof( uint8 ) );
+  assert( fb.accum && fb.samples && fb.lum_sq && fb.active && fb.image );
+  memset( fb.active, 1, nx * ny * sizeof( uint8 ) );
+  return fb;
+}
+
+void framebuffer_clear( Framebuffer &fb ){
+  memset( fb.accum, 0, fb.nx * fb.ny * sizeof( v3 ) );
+  memset( fb.samples, 0, fb.nx * fb.ny * sizeof( uint32 ) );
+  memset( fb.lum_sq, 0, fb.nx * fb.ny * sizeof( float ) );
+  memset( fb.active, 1, fb.nx * fb.ny * sizeof( uint8 ) );
+}
+
+void framebuffer_free( Framebuffer &fb ){
+  free( fb.accum );
+  free( fb.samples );
+  free( fb.lum_sq );
+  free( fb.active );
+  free( fb.image );
+  fb.accum = NULL;
+  fb.samples = NULL;
+  fb.lum_sq = NULL;
+  fb.active = NULL;
+  fb.image = NULL;
+}
+
+// Standard error of the pixel's mean luminance relative to the mean,
+// from the running sums. Pixels with less than two samples have an
+// unknown error and return FLT_MAX.
+float framebuffer_relative_error( const Framebuffer &fb, int p ){
+  uint32 n = fb.samples[p];
+  if ( n < 2 ) return FLT_MAX;
+  float mean = luminance( fb.accum[p] ) / n;
+  float var = ( fb.lum_sq[p] / n - mean * mean ) * n / ( n - 1 );
+  if ( var <= 0.0f ) return 0.0f;
+  // the small offset keeps almost black pixels from never converging
+  return sqrtf( var / n ) / ( mean + 1e-3f );
+}
+
+// A pixel stays active until it has min_samples and neither it nor
+// any of its eight neighbours has a relative error above threshold.
+// Looking at the neighbourhood keeps dim pixels whose first few paths
+// all happened to miss the lights from being retired as converged.
+// Returns the number of active pixels.
+int framebuffer_update_active(
+    Framebuffer &fb,
+    uint32 min_samples,
+    float threshold )
+{
+  int nx = fb.nx, ny = fb.ny;
+  float *err = ( float *)malloc( nx * ny * sizeof( float ) );
+  for ( int p = 0; p < nx * ny; p++ ){
+    err[p] = framebuffer_relative_error( fb, p );
+  }
+
+  int active = 0;
+  for ( int y = 0; y < ny; y++ ){
+    for ( int x = 0; x < nx; x++ ){
+      int p = y * nx + x;
+      float max_err = 0.0f;
+      for ( int dy = MAX( y - 1, 0 ); dy <= MIN( y + 1, ny - 1 ); dy++ ){
+        for ( int dx = MAX( x - 1, 0 ); dx <= MIN( x + 1, nx - 1 ); dx++ ){
+          max_err = MAX( max_err, err[ dy * nx + dx ] );
+        }
+      }
+      fb.active[p] = fb.samples[p] < min_samples || max_err > threshold;
+      active += fb.active[p];
+    }
+  }
+  free( err );
+  return active;
+}
+
+// Averages the samples and applies the gamma ( sqrt ), pixels without
+// any samples come out black
+void framebuffer_resolve( Framebuffer &fb ){
+  uint8 *start = fb.image;
+  for ( int p = 0; p < fb.nx * fb.ny; p++ ){
+    v3 color = { 0.0f, 0.0f, 0.0f };
+    if ( fb.samples[p] ){
+      color = fb.accum[p] / (float)fb.samples[p];
+    }
+    color = { HMM_SquareRootF( color[0] ),
+              HMM_SquareRootF( color[1] ),
+              HMM_SquareRootF( color[2] ) };
+
+    int ir = (int)(255.99 * CLAMP( color[0], 0.0f, 1.0f ) );
+    int ig = (int)(255.99 * CLAMP( color[1], 0.0f, 1.0f ) );
+    int ib = (int)(255.99 * CLAMP( color[2], 0.0f, 1.0f ) );
+
+    *start++ = ir & 0xff;
+    *start++ = ig & 0xff;
+    *start++ = ib & 0xff;
+  }
+}
+
+// Raw dump of the accumulation state, the image is not saved as it
+// can be resolved again. Both return false on a short read or write.
+bool framebuffer_save( const Framebuffer &fb, FILE *fp ){
+  size_t n = fb.nx * fb.ny;
+  return fwrite( fb.accum, sizeof( v3 ), n, fp ) == n &&
+         fwrite( fb.samples, sizeof( uint32 ), n, fp ) == n &&
+         fwrite( fb.lum_sq, sizeof( float ), n, fp ) == n &&
+         fwrite( fb.active, sizeof( uint8 ), n, fp ) == n;
+}
+
+bool framebuffer_load( Framebuffer &fb, FILE *fp ){
+  size_t n = fb.nx * fb.ny;
+  return fread( fb.accum, sizeof( v3 ), n, fp ) == n &&
+         fread( fb.samples, sizeof( uint32 ), n, fp ) == n &&
+         fread( fb.lum_sq, sizeof( float ), n, fp ) == n &&
+         fread( fb.active, sizeof( uint8 ), n, fp ) == n;
+}
+
+// Accumulation file, the linear sums of a render without any gamma
+// or quantization. Files of independent renders of the same frame
+// are merged by adding them up, i.e. weighted by their sample counts.
+// Header, then the accum, samples and lum_sq arrays.
+#define ACCUM_MAGIC 0x43434152 // "RACC"
+#define ACCUM_VERSION 1
+
+struct AccumHeader {
+  uint32 magic;
+  uint32 version;
+  int32 nx, ny;
+};
+
+bool framebuffer_write_accum( const Framebuffer &fb, const char *path ){
+  FILE *fp = fopen( path, "wb" );
+  if ( !fp ){
+    fprintf( stderr, "%s, ", path );
+    perror( "Unable to write accumulation file! " );
+    return false;
+  }
+  AccumHeader header = { ACCUM_MAGIC, ACCUM_VERSION, fb.nx, fb.ny };
+  size_t n = fb.nx * fb.ny;
+  bool ok = fwrite( &header, sizeof( header ), 1, fp ) == 1 &&
+            fwrite( fb.accum, sizeof( v3 ), n, fp ) == n &&
+            fwrite( fb.samples, sizeof( uint32 ), n, fp ) == n &&
+            fwrite( fb.lum_sq, sizeof( float ), n, fp ) == n;
+  ok = ( fclose( fp ) == 0 ) && ok;
+  if ( !ok ){
+    fprintf( stderr, "Unable to write accumulation file %s\n", path );
+  }
+  return ok;
+}
+
+// Creates the framebuffer from the file
+bool framebuffer_read_accum( Framebuffer &fb, const char *path ){
+  FILE *fp = fopen( path, "rb" );
+  if ( !fp ){
+    fprintf( stderr, "%s, ", path );
+    perror( "Unable to open accumulation file! " );
+    return false;
+  }
+  AccumHeader header;
+  if ( fread( &header, sizeof( header ), 1, fp ) != 1 ||
+       header.magic != ACCUM_MAGIC || header.version != ACCUM_VERSION ||
+       header.nx <= 0 || header.ny <= 0 )
+  {
+    fprintf( stderr, "%s is not an accumulation file\n", path );
+    fclose( fp );
+    return false;
+  }
+  fb = framebuffer_create( header.nx, header.ny );
+  size_t n = fb.nx * fb.ny;
+  bool ok = fread( fb.accum, sizeof( v3 ), n, fp ) == n &&
+            fread( fb.samples, sizeof( uint32 ), n, fp ) == n &&
+            fread( fb.lum_sq, sizeof( float ), n, fp ) == n;
+  fclose( fp );
+  if ( !ok ){
+    fprintf( stderr, "Accumulation file %s is truncated\n", path );
+    framebuffer_free( fb );
+  }
+  return ok;
+}
+
+// dst += src, both must have the same size
+void framebuffer_add( Framebuffer &dst, const Framebuffer &src ){
+  assert( dst.nx == src.nx && dst.ny == src.ny );
+  for ( int p = 0; p < dst.nx * dst.ny; p++ ){
+    dst.accum[p] += src.accum[p];
+    dst.samples[p] += src.samples[p];
+    dst.lum_sq[p] += src.lum_sq[p];
+  }
+}
+
+bool framebuffer_write_png( Framebuffer &fb, const char *path ){
+  framebuffer_resolve( fb );
+  if ( !stbi_write_png( path, fb.nx, fb.ny, 3, fb.image, 3 * fb.nx ) ){
+    fprintf( stderr, "Unable to write image to %s\n", path );
+    return false;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef NET_H
+#define NET_H
+
+#include "common.h"
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Blocking stream sockets, TCP or unix domain. Addresses are
+// "unix:/path/to/socket", "host:port" or ":port" ( all interfaces ).
+// Every message is a NetHeader followed by size bytes of payload.
+
+#define NET_MAX_MESSAGE ( 256u << 20 )
+
+struct NetHeader {
+  uint32 type;
+  uint32 size;
+};
+
+static bool net_is_unix( const char *addr ){
+  return !strncmp( addr, "unix:", 5 );
+}
+
+static bool net_unix_address( const char *addr, sockaddr_un &sa ){
+  const char *path = addr + 5;
+  memset( &sa, 0, sizeof( sa ) );
+  sa.sun_family = AF_UNIX;
+  if ( strlen( path ) >= sizeof( sa.sun_path ) ){
+    fprintf( stderr, "Socket path too long: %s\n", path );
+    return false;
+  }
+  strcpy( sa.sun_path, path );
+  return true;
+}
+
+// Splits "host:port", host is empty for ":port"
+static bool net_split_address( const char *addr, char *host, size_t size,
+                               const char **port )
+{
+  const char *colon = strrchr( addr, ':' );
+  if ( !colon || !colon[1] ){
+    fprintf( stderr, "Invalid address %s, expected host:port or"
+                     " unix:path\n", addr );
+    return false;
+  }
+  size_t len = colon - addr;
+  if ( len >= size ) return false;
+  memcpy( host, addr, len );
+  host[len] = 0;
+  *port = colon + 1;
+  return true;
+}
+
+static void net_set_options( int fd ){
+  // A peer that stops responding in the middle of a message makes the
+  // read fail instead of blocking forever
+  timeval tv = { 30, 0 };
+  setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+  setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+  int one = 1;
+  setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+}
+
+// Returns the listening socket or -1
+int net_listen( const char *addr ){
+  if ( net_is_unix( addr ) ){
+    sockaddr_un sa;
+    if ( !net_unix_address( addr, sa ) ) return -1;
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 ){
+      perror( "Unable to create socket! " );
+      return -1;
+    }
+    unlink( sa.sun_path );
+    if ( bind( fd, ( sockaddr *)&sa, sizeof( sa ) ) < 0 ||
+         listen( fd, 64 ) < 0 )
+    {
+      fprintf( stderr, "%s, ", addr );
+      perror( "Unable to listen! " );
+      close( fd );
+      return -1;
+    }
+    return fd;
+  }
+
+  char host[256];
+  const char *port;
+  if ( !net_split_address( addr, host, sizeof( host ), &port ) ) return -1;
+  addrinfo hints = {}, *res;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  int err = getaddrinfo( host[0] ? host : NULL, port, &hints, &res );
+  if ( err ){
+    fprintf( stderr, "%s: %s\n", addr, gai_strerror( err ) );
+    return -1;
+  }
+  int fd = -1;
+  for ( addrinfo *ai = res; ai; ai = ai->ai_next ){
+    fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+    if ( fd < 0 ) continue;
+    int one = 1;
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+    if ( bind( fd, ai->ai_addr, ai->ai_addrlen ) == 0 &&
+         listen( fd, 64 ) == 0 )
+    {
+      break;
+    }
+    close( fd );
+    fd = -1;
+  }
+  freeaddrinfo( res );
+  if ( fd < 0 ){
+    fprintf( stderr, "%s, ", addr );
+    perror( "Unable to listen! " );
+  }
+  return fd;
+}
+
+// Returns the connected socket or -1
+int net_connect( const char *addr ){
+  int fd = -1;
+  if ( net_is_unix( addr ) ){
+    sockaddr_un sa;
+    if ( !net_unix_address( addr, sa ) ) return -1;
+    fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd >= 0 && connect( fd, ( sockaddr *)&sa, sizeof( sa ) ) < 0 ){
+      close( fd );
+      fd = -1;
+    }
+  } else {
+    char host[256];
+    const char *port;
+    if ( !net_split_address( addr, host, sizeof( host ), &port ) ) return -1;
+    addrinfo hints = {}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo( host[0] ? host : "localhost", port, &hints, &res );
+    if ( err ){
+      fprintf( stderr, "%s: %s\n", addr, gai_strerror( err ) );
+      return -1;
+    }
+    for ( addrinfo *ai = res; ai; ai = ai->ai_next ){
+      fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+      if ( fd < 0 ) continue;
+      if ( connect( fd, ai->ai_addr, ai->ai_addrlen ) == 0 ) break;
+      close( fd );
+      fd = -1;
+    }
+    freeaddrinfo( res );
+  }
+  if ( fd >= 0 ) net_set_options( fd );
+  return fd;
+}
+
+// Returns the accepted socket or -1
+int net_accept( int listen_fd ){
+  int fd = accept( listen_fd, NULL, NULL );
+  if ( fd >= 0 ) net_set_options( fd );
+  return fd;
+}
+
+bool net_send_all( int fd, const void *data, size_t size ){
+  const uint8 *p = ( const uint8 *)data;
+  while ( size > 0 ){
+    ssize_t n = send( fd, p, size, MSG_NOSIGNAL );
+    if ( n < 0 && errno == EINTR ) continue;
+    if ( n <= 0 ) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool net_recv_all( int fd, void *data, size_t size ){
+  uint8 *p = ( uint8 *)data;
+  while ( size > 0 ){
+    ssize_t n = recv( fd, p, size, 0 );
+    if ( n < 0 && errno == EINTR ) continue;
+    if ( n <= 0 ) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// The payload may be split in two parts so headers of variable size
+// messages don't need to be copied in front of the data
+bool net_send_message( int fd, uint32 type,
+                       const void *a, uint32 a_size,
+                       const void *b = NULL, uint32 b_size = 0 )
+{
+  NetHeader header = { type, a_size + b_size };
+  return net_send_all( fd, &header, sizeof( header ) ) &&
+         net_send_all( fd, a, a_size ) &&
+         net_send_all( fd, b, b_size );
+}
+
+// Reads a whole message, the payload is stored in the stretchy buffer
+// payload which is grown as needed
+bool net_recv_message( int fd, NetHeader &header, uint8 *&payload ){
+  if ( !net_recv_all( fd, &header, sizeof( header ) ) ||
+       header.size > NET_MAX_MESSAGE )
+  {
+    return false;
+  }
+  if ( payload ){
+    array_clear( payload );
+  } else {
+    payload = array_allocate( uint8, MAX( header.size, 16u ) );
+  }
+  if ( header.size > array_capacity( payload ) &&
+       !internal_array_grow( ( void **)&payload, header.size,
+                             sizeof( uint8 ) ) )
+  {
+    return false;
+  }
+  array_buffer_hdr( payload )->length = header.size;
+  return net_recv_all( fd, payload, header.size );
+}
+
+#endif
@@ -42,25 +42,77 @@ static inline uint64_t rotl(const uint64_t x, int k) {
 }
 
 
-static uint64_t PRNG_Seed[4];
+// Generator state. Anything that runs on more than one thread keeps
+// its own PRNG, separated from the others with prng_jump() or
+// prng_long_jump() so that the streams never overlap.
+struct PRNG {
+  uint64_t s[4];
+};
 
-uint64_t PRNG_Next(void) {
-	const uint64_t result = PRNG_Seed[0] + PRNG_Seed[3];
+// State behind prng_float() and prng_uint64(), main thread only
+static PRNG PRNG_Global;
+
+uint64_t prng_next( PRNG *rng ) {
+	uint64_t *s = rng->s;
+	const uint64_t result = s[0] + s[3];
 
-	const uint64_t t = PRNG_Seed[1] << 17;
+	const uint64_t t = s[1] << 17;
 
-	PRNG_Seed[2] ^= PRNG_Seed[0];
-	PRNG_Seed[3] ^= PRNG_Seed[1];
-	PRNG_Seed[1] ^= PRNG_Seed[2];
-	PRNG_Seed[0] ^= PRNG_Seed[3];
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
 
-	PRNG_Seed[2] ^= t;
+	s[2] ^= t;
 
-	PRNG_Seed[3] = rotl(PRNG_Seed[3], 45);
+	s[3] = rotl(s[3], 45);
 
 	return result;
 }
 
+uint64_t PRNG_Next(void) {
+	return prng_next( &PRNG_Global );
+}
+
+static void prng_apply_jump( PRNG *rng, const uint64_t *jump ) {
+	uint64_t s0 = 0;
+	uint64_t s1 = 0;
+	uint64_t s2 = 0;
+	uint64_t s3 = 0;
+	for(int i = 0; i < 4; i++)
+		for(int b = 0; b < 64; b++) {
+			if (jump[i] & UINT64_C(1) << b) {
+				s0 ^= rng->s[0];
+				s1 ^= rng->s[1];
+				s2 ^= rng->s[2];
+				s3 ^= rng->s[3];
+			}
+			prng_next( rng );	
+		}
+		
+	rng->s[0] = s0;
+	rng->s[1] = s1;
+	rng->s[2] = s2;
+	rng->s[3] = s3;
+}
+
+/* This is the jump function for the generator. It is equivalent
+   to 2^128 calls to next(); it can be used to generate 2^128
+   non-overlapping subsequences for parallel computations. */
+void prng_jump( PRNG *rng ) {
+	static const uint64_t JUMP[] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+	prng_apply_jump( rng, JUMP );
+}
+
+/* This is the long-jump function for the generator. It is equivalent to
+   2^192 calls to next(); it can be used to generate 2^64 starting points,
+   from each of which jump() will generate 2^64 non-overlapping
+   subsequences for parallel distributed computations. */
+void prng_long_jump( PRNG *rng ) {
+	static const uint64_t LONG_JUMP[] = { 0x76e15d3efefdcbbf, 0xc5004e441c522fb3, 0x77710069854ee241, 0x39109bb02acbe635 };
+	prng_apply_jump( rng, LONG_JUMP );
+}
+
 struct splitmix64_state {
 	uint64_t s;
 };
@@ -74,14 +126,14 @@ uint64_t splitmix64(struct splitmix64_state *state) {
 	return result ^ (result >> 31);
 }
 
-void prng_seed( ){
-  uint8_t buff[8];
+// Returns a seed from the OS, 0 if it could not be read
+uint64_t prng_random_seed( ){
+  uint8_t buff[8] = {};
 #ifdef OS_LINUX_CPP
   int fd = open("/dev/urandom",O_RDONLY);
   assert( fd > 0 );
   if ( read( fd, buff, 8 ) < 0 ){
     fprintf(stderr,"Error Occured!\n");
-    return;
   }
   close( fd );
 #elif defined(OS_WINDOWS_CPP)
@@ -89,24 +141,34 @@ void prng_seed( ){
   QueryPerformanceCounter( &large );
   memcpy( (void *)buff, (void *)&large, sizeof( buff ) );
 #endif 
-  struct splitmix64_state state = { *(uint64_t *)&buff };
-  uint64_t s0 = splitmix64( &state );
-  uint64_t s1 = splitmix64( &state );
-  uint64_t s2 = splitmix64( &state );
-  uint64_t s3 = splitmix64( &state );
-
-  PRNG_Seed[0] = s0; 
-  PRNG_Seed[1] = s1; 
-  PRNG_Seed[2] = s2; 
-  PRNG_Seed[3] = s3; 
-  return;  
+  return *(uint64_t *)&buff;
 }
 
-float prng_float(){
-  uint64_t x = PRNG_Next( );
+void prng_init( PRNG *rng, uint64_t seed ){
+  struct splitmix64_state state = { seed };
+  rng->s[0] = splitmix64( &state );
+  rng->s[1] = splitmix64( &state );
+  rng->s[2] = splitmix64( &state );
+  rng->s[3] = splitmix64( &state );
+}
+
+void prng_seed( uint64_t seed ){
+  prng_init( &PRNG_Global, seed );
+}
+
+void prng_seed( ){
+  prng_seed( prng_random_seed() );
+}
+
+float prng_float( PRNG *rng ){
+  uint64_t x = prng_next( rng );
   return (x >> 11) * 0x1.0p-53;
 }
 
+float prng_float(){
+  return prng_float( &PRNG_Global );
+}
+
 uint64_t prng_uint64(){
   return PRNG_Next();
 }
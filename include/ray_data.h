@@ -14,9 +14,14 @@ struct DumpCameraData {
 
 
 struct DumpObjectData {
+  // The objects following a SHAPE record are its parts, in the shape's
+  // own space. They are only rendered where INSTANCE records place the
+  // shape, by its index among the SHAPE records of the file.
   enum DumpObjectType : uint8 {
     RECTANGLE = 0, 
-    SPHERE = 1
+    SPHERE = 1,
+    SHAPE = 2,
+    INSTANCE = 3
   };
 
   enum DumpMaterialType : uint8 {
@@ -45,6 +50,15 @@ struct DumpObjectData {
       v3 p0, s1, s2, n;
       f32 l1, l2;
     };
+    struct {
+      uint32 shape_objects; // records of the shape after this one
+    };
+    struct {
+      uint32 shape_index;
+      v3 position;
+      f32 orientation[4]; // unit quaternion x, y, z, w
+      f32 scale;
+    };
   } object_data;
 
   uint8 material_type;
@@ -0,0 +1,178 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+
+typedef void (*TaskFunc)( void *data, int worker );
+
+// Tasks of a higher priority are always taken before lower ones,
+// 0 is the lowest
+#define THREAD_POOL_PRIORITIES 4
+
+// Lets a thread wait for its own tasks only, when several threads
+// submit work to the same pool
+struct TaskGroup {
+  std::atomic<int> pending;
+};
+
+struct Task {
+  TaskFunc func;
+  void *data;
+  TaskGroup *group;
+};
+
+// Every worker owns a deque. Tasks are pushed at the back and the owner
+// takes them from the front, so tasks of the same priority run in the
+// order they were submitted and threads sharing the pool take turns.
+// Idle workers steal from the back of other deques, i.e. they take the
+// work the owner would have reached last.
+struct WorkDeque {
+  std::mutex lock;
+  std::deque<Task> tasks;
+};
+
+struct ThreadPool {
+  std::thread *threads;
+  WorkDeque *queues[ THREAD_POOL_PRIORITIES ]; // one per worker and level
+  int thread_count;
+
+  std::mutex lock;
+  std::condition_variable wake; // signalled when work is submitted
+  std::condition_variable done; // signalled when pending or the pending
+                                // count of a group drops to 0
+  std::atomic<int> queued;      // tasks sitting in some deque
+  std::atomic<int> pending;     // tasks submitted but not finished
+  uint next_queue;              // round robin for submission
+  bool quit;
+};
+
+static bool work_deque_pop( WorkDeque *q, Task *t ){
+  std::lock_guard<std::mutex> guard( q->lock );
+  if ( q->tasks.empty() ) return false;
+  *t = q->tasks.front();
+  q->tasks.pop_front();
+  return true;
+}
+
+static bool work_deque_steal( WorkDeque *q, Task *t ){
+  std::lock_guard<std::mutex> guard( q->lock );
+  if ( q->tasks.empty() ) return false;
+  *t = q->tasks.back();
+  q->tasks.pop_back();
+  return true;
+}
+
+static bool thread_pool_find_task( ThreadPool *pool, int worker, Task *t ){
+  for ( int p = THREAD_POOL_PRIORITIES - 1; p >= 0; p-- ){
+    WorkDeque *queues = pool->queues[p];
+    if ( work_deque_pop( &queues[ worker ], t ) ){
+      pool->queued--;
+      return true;
+    }
+    for ( int i = 1; i < pool->thread_count; i++ ){
+      int victim = ( worker + i ) % pool->thread_count;
+      if ( work_deque_steal( &queues[ victim ], t ) ){
+        pool->queued--;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void thread_pool_worker( ThreadPool *pool, int worker ){
+  for ( ;; ){
+    Task t;
+    if ( thread_pool_find_task( pool, worker, &t ) ){
+      t.func( t.data, worker );
+      bool group_done = t.group && --t.group->pending == 0;
+      if ( --pool->pending == 0 || group_done ){
+        std::lock_guard<std::mutex> guard( pool->lock );
+        pool->done.notify_all();
+      }
+      continue;
+    }
+    std::unique_lock<std::mutex> guard( pool->lock );
+    pool->wake.wait( guard, [pool]{
+        return pool->quit || pool->queued > 0; } );
+    if ( pool->quit ) return;
+  }
+}
+
+ThreadPool *thread_pool_create( int thread_count ){
+  assert( thread_count > 0 );
+  ThreadPool *pool = new ThreadPool;
+  pool->thread_count = thread_count;
+  pool->queued = 0;
+  pool->pending = 0;
+  pool->next_queue = 0;
+  pool->quit = false;
+  for ( int p = 0; p < THREAD_POOL_PRIORITIES; p++ ){
+    pool->queues[p] = new WorkDeque[ thread_count ];
+  }
+  pool->threads = new std::thread[ thread_count ];
+  for ( int i = 0; i < thread_count; i++ ){
+    pool->threads[i] = std::thread( thread_pool_worker, pool, i );
+  }
+  return pool;
+}
+
+// Tasks are dealt out round robin so that neighbouring tasks end up
+// on different workers, stealing takes care of the rest. With a group
+// the tasks are added to it, see thread_pool_wait_group().
+void thread_pool_submit(
+    ThreadPool *pool,
+    Task *tasks,
+    int count,
+    int priority = 0,
+    TaskGroup *group = NULL )
+{
+  priority = CLAMP( priority, 0, THREAD_POOL_PRIORITIES - 1 );
+  if ( group ) group->pending += count;
+  pool->pending += count;
+  for ( int i = 0; i < count; i++ ){
+    WorkDeque *q = &pool->queues[ priority ][ pool->next_queue++ %
+                                              pool->thread_count ];
+    Task t = tasks[i];
+    t.group = group;
+    std::lock_guard<std::mutex> guard( q->lock );
+    q->tasks.push_back( t );
+  }
+  std::lock_guard<std::mutex> guard( pool->lock );
+  pool->queued += count;
+  pool->wake.notify_all();
+}
+
+// Blocks until every submitted task has finished
+void thread_pool_wait( ThreadPool *pool ){
+  std::unique_lock<std::mutex> guard( pool->lock );
+  pool->done.wait( guard, [pool]{ return pool->pending == 0; } );
+}
+
+// Blocks until every task submitted with the group has finished
+void thread_pool_wait_group( ThreadPool *pool, TaskGroup *group ){
+  std::unique_lock<std::mutex> guard( pool->lock );
+  pool->done.wait( guard, [group]{ return group->pending == 0; } );
+}
+
+void thread_pool_destroy( ThreadPool *pool ){
+  {
+    std::lock_guard<std::mutex> guard( pool->lock );
+    pool->quit = true;
+    pool->wake.notify_all();
+  }
+  for ( int i = 0; i < pool->thread_count; i++ ){
+    pool->threads[i].join();
+  }
+  delete [] pool->threads;
+  for ( int p = 0; p < THREAD_POOL_PRIORITIES; p++ ){
+    delete [] pool->queues[p];
+  }
+  delete pool;
+}
+
+#endif
@@ -61,10 +61,10 @@ void *arena_alloc( Arena *arena, size_t size, size_t align ){
   uint len = array_length( arena->buff );
   // search through arenas to find a suitable block
   for ( uint i = 0; i < len; i++ ){
-    if ( arena->buff_capacity[i] >= arena->buff_len[i] + size ){
-      void *p = ( char *)arena->buff[i] + arena->buff_len[i];
-      void *ptr = ALIGN_UP_PTR( p, align );
-      ptrdiff diff = (char *)ptr - (char *)p;
+    void *p = ( char *)arena->buff[i] + arena->buff_len[i];
+    void *ptr = ALIGN_UP_PTR( p, align );
+    ptrdiff diff = (char *)ptr - (char *)p;
+    if ( arena->buff_capacity[i] >= arena->buff_len[i] + diff + size ){
       arena->buff_len[ i ] += ( size + ( uint )diff );
       return ptr;
     }
@@ -75,12 +75,15 @@ void *arena_alloc( Arena *arena, size_t size, size_t align ){
     fprintf( stderr, "size exceeds the max. size that can be alloced at once" );
     return NULL;
   }
-  size_t n_size = MAX( DEFAULT_ARENA_SIZE, 2 * size );
+  // malloc only guarantees 16 byte alignment, leave room to align up
+  size_t n_size = MAX( DEFAULT_ARENA_SIZE, 2 * size + align );
   void *x = xcalloc( 1, n_size );
+  void *ptr = ALIGN_UP_PTR( x, align );
+  ptrdiff diff = (char *)ptr - (char *)x;
   array_push( arena->buff, x );
-  array_push( arena->buff_len, size );
+  array_push( arena->buff_len, size + diff );
   array_push( arena->buff_capacity, n_size );
-  return x;
+  return ptr;
 }
 
 void arena_free( Arena *arena ){
@@ -92,6 +95,14 @@ void arena_free( Arena *arena ){
   array_free( arena->buff );
 }
 
+// Makes all the blocks available again without freeing them,
+// the memory is not cleared
+void arena_reset( Arena *arena ){
+  for ( uint i = 0; i < array_length( arena->buff ); i++ ){
+    arena->buff_len[i] = 0;
+  }
+}
+
 Arena new_arena( void ){
   Arena a;
   a.buff = NULL;
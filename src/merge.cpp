@@ -0,0 +1,91 @@
+#define HANDMADE_MATH_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#define OS_LINUX_CPP
+//#define OS_WINDOWS_CPP
+#include <stdio.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <float.h>
+
+#include "HandmadeMath.h"
+#include "common.h"
+#include "stb_image_write.h"
+#include "framebuffer.h"
+
+// Combines the accumulation files written by `app --accum` into one
+// image. The sums and sample counts are added, so every run counts
+// with the number of samples it took.
+void print_usage( const char *prog ){
+  fprintf( stderr, "Usage: %s [options] FILE.acc...\n", prog );
+  fprintf( stderr, "  --out PATH     output image"
+                   " ( default: ./images/out.png )\n" );
+  fprintf( stderr, "  --accum PATH   also write the merged accumulation"
+                   " file\n" );
+}
+
+int main( int argc, char **argv ){
+  const char *output = "./images/out.png";
+  const char *accum_output = NULL;
+  char **inputs = NULL;
+  for ( int i = 1; i < argc; i++ ){
+    const char *arg = argv[i];
+    if ( !strcmp( arg, "--out" ) || !strcmp( arg, "-o" ) ){
+      if ( ++i >= argc ){
+        print_usage( argv[0] );
+        return 1;
+      }
+      output = argv[i];
+    } else if ( !strcmp( arg, "--accum" ) ){
+      if ( ++i >= argc ){
+        print_usage( argv[0] );
+        return 1;
+      }
+      accum_output = argv[i];
+    } else if ( arg[0] == '-' ){
+      print_usage( argv[0] );
+      return 1;
+    } else {
+      array_push( inputs, argv[i] );
+    }
+  }
+  if ( array_length( inputs ) == 0 ){
+    print_usage( argv[0] );
+    return 1;
+  }
+
+  Framebuffer merged;
+  if ( !framebuffer_read_accum( merged, inputs[0] ) ) return 1;
+  for ( uint i = 1; i < array_length( inputs ); i++ ){
+    Framebuffer fb;
+    if ( !framebuffer_read_accum( fb, inputs[i] ) ) return 1;
+    if ( fb.nx != merged.nx || fb.ny != merged.ny ){
+      fprintf( stderr, "%s is %dx%d, expected %dx%d\n",
+               inputs[i], fb.nx, fb.ny, merged.nx, merged.ny );
+      return 1;
+    }
+    framebuffer_add( merged, fb );
+    framebuffer_free( fb );
+  }
+
+  uint64_t total = 0;
+  uint32 min_samples = UINT32_MAX, max_samples = 0;
+  for ( int p = 0; p < merged.nx * merged.ny; p++ ){
+    total += merged.samples[p];
+    min_samples = MIN( min_samples, merged.samples[p] );
+    max_samples = MAX( max_samples, merged.samples[p] );
+  }
+  printf( "Merged %u files, %dx%d, %.1f spp on average"
+          " ( min. %u, max. %u )\n",
+          array_length( inputs ), merged.nx, merged.ny,
+          (double)total / ( merged.nx * merged.ny ),
+          min_samples, max_samples );
+
+  if ( accum_output && !framebuffer_write_accum( merged, accum_output ) ){
+    return 1;
+  }
+  if ( !framebuffer_write_png( merged, output ) ) return 1;
+  printf( "Wrote %s\n", output );
+  framebuffer_free( merged );
+  array_free( inputs );
+  return 0;
+}
@@ -6,7 +6,17 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <float.h>
+#include <signal.h>
 #include <vector>
+#include <chrono>
+#include <deque>
+#include <algorithm>
+#include <immintrin.h>
+#ifdef OS_LINUX_CPP
+#include <glob.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#endif
 
 #include "HandmadeMath.h"
 #include "prng.h"
@@ -15,6 +25,9 @@
 #include "primitives.h"
 #include "texture.h"
 #include "ray_data.h"
+#include "thread_pool.h"
+#include "framebuffer.h"
+#include "net.h"
 #define ANTI_ALIASING_ON 
 #if 1
 typedef unsigned int uint;
@@ -42,11 +55,11 @@ inline float schlick( float c, float ri ){
   return r0 + ( 1-r0 )*pow( 1-c, 5 );
 }
 
-v3 random_in_unit_disk( ){
+v3 random_in_unit_disk( PRNG *rng ){
   v3 y;
   float dist;
   do {
-    v3 p = { prng_float(), prng_float(), 0.0f };
+    v3 p = { prng_float( rng ), prng_float( rng ), 0.0f };
     y = 2 * p - v3{1.0f,1.0f,0.0f};
     dist = HMM_DotVec3( p, p );
   } while( dist >= 1.0f );
@@ -56,20 +69,20 @@ v3 random_in_unit_disk( ){
 
 #if 0
 
-v3 random_in_unit_sphere( void ){
-  v3 v = { prng_float(), prng_float(), prng_float() };
+v3 random_in_unit_sphere( PRNG *rng ){
+  v3 v = { prng_float( rng ), prng_float( rng ), prng_float( rng ) };
   float m = HMM_DotVec3( v, v );
   if ( m < 1.0f ) return v;
   return HMM_NormalizeVec3( v )/m;
 }
 
 #else
-v3 random_in_unit_sphere( void ){
+v3 random_in_unit_sphere( PRNG *rng ){
   float dist;
   v3 p,y;
   do {
     // Generate a random point between (-1,-1,-1 ) and ( 1,1,1 )
-    p = { prng_float(),prng_float(), prng_float()}; 
+    p = { prng_float( rng ),prng_float( rng ), prng_float( rng )}; 
     y = v3{ -1.0f, -1.0f, -1.0f } + 2 * p;
     dist = HMM_DotVec3( y , y );
   } while ( dist >= 1.0f );
@@ -126,8 +139,8 @@ struct Camera {
 
   Camera () {}
 
-  inline Ray get_ray( float u, float v ){
-    v3 x = lens_radius * random_in_unit_disk();
+  inline Ray get_ray( float u, float v, PRNG *rng ){
+    v3 x = lens_radius * random_in_unit_disk( rng );
     v3 off = x.X * right + x.Y * up;
     v3 start = origin + off;
     return Ray( start, lower_left - start + u * horizontal+ v *vertical);
@@ -156,7 +169,20 @@ typedef bool (*ScatterFunc)(
     const HitRecord &h,
     const Ray &in,
     v3 &attenuation,
-    Ray &out );
+    Ray &out,
+    PRNG *rng );
+
+struct Shape;
+
+// A shape placed in the world, rotated, scaled evenly and moved. axes
+// are the shape's x, y and z axes in world space.
+struct Instance {
+  Shape *shape;
+  v3 position;
+  v3 axes[3];
+  float scale;
+  AABB box; // in world space, see scene_build_shapes()
+};
 
 struct World {
   Sphere *spheres;
@@ -175,6 +201,9 @@ struct World {
   uint rect_count;
   uint rect_cap;
 
+  Instance *instances;
+  uint instance_count;
+  uint instance_cap;
 };
 
 
@@ -253,9 +282,10 @@ bool pure_diffuse_scatter(
     const HitRecord &rec,
     const Ray &in,
     v3 &attenuation,
-    Ray &out )
+    Ray &out,
+    PRNG *rng )
 {
-  v3 dir = rec.n + random_in_unit_sphere();
+  v3 dir = rec.n + random_in_unit_sphere( rng );
   out = Ray( rec.p , dir );
   Texture *t = rec.m->albedo;
   attenuation = t->get_color( t, 0,0, rec.p );
@@ -267,10 +297,11 @@ bool metallic_scatter(
     const HitRecord &rec,
     const Ray &in,
     v3 &attenuation,
-    Ray &out )
+    Ray &out,
+    PRNG *rng )
 {
   v3 dir = HMM_Reflect( HMM_NormalizeVec3(in.direction), rec.n ) +
-           rec.m->fuzz * random_in_unit_sphere();
+           rec.m->fuzz * random_in_unit_sphere( rng );
   out = Ray( rec.p, dir );
   Texture *t = rec.m->albedo;
   attenuation = t->get_color( t, 0,0, rec.p );
@@ -281,7 +312,8 @@ bool refraction_scatter(
     const HitRecord &rec,
     const Ray &in,
     v3 &attenuation,
-    Ray &out )
+    Ray &out,
+    PRNG *rng )
 {
   Material *m = rec.m;
   float ri;
@@ -313,7 +345,7 @@ bool refraction_scatter(
     reflect_prob = 1.0f; 
   }
   
-  if ( prng_float() < reflect_prob ){
+  if ( prng_float( rng ) < reflect_prob ){
     out = Ray( rec.p, reflect_dir );
   } else {
     out = Ray( rec.p, refract_dir );
@@ -325,7 +357,8 @@ inline bool no_scatter(
     const HitRecord &h,
     const Ray &in,
     v3 &attenuation,
-    Ray &out ){ return false; }
+    Ray &out,
+    PRNG *rng ){ return false; }
 
 Material create_diffuse_light( const v3 &color ){
   Material m;
@@ -526,7 +559,8 @@ struct PrimInfo {
   typedef enum PrimType {
     SPHERE,
     PLANE,
-    RECTANGLE
+    RECTANGLE,
+    INSTANCE
   } PrimType;
 
   PrimType type;
@@ -543,25 +577,14 @@ struct PrimInfo {
 };
 
 
-int partition(
-    void *start,
-    int length,
-    size_t size,
-    int (*filter)(void *, void *),
-    void *extra_args )
-{
+// Moves the items the predicate holds for to the front by swapping
+// each with the leftmost other one and returns their count
+template <typename T, typename Pred>
+inline int partition( T *items, int length, Pred pred ){
   int left = 0;
-  char temp[1024];
-  assert( sizeof( temp ) >= size );
   for ( int i = 0; i < length; i++ ){
-    char *current = ( char *)start + i * size;
-    if ( filter( (void *)current, extra_args ) ){
-      //swap with the leftmost element
-      char *l = (char *)start + left *size;
-      char *c = (char *)start + i * size;
-      memcpy( temp, l , size );
-      memcpy( l, c, size );
-      memcpy( c, temp, size );
+    if ( pred( items[i] ) ){
+      std::swap( items[left], items[i] );
       left++;
     }
   }
@@ -598,26 +621,41 @@ AABB AABB_union( AABB b1, AABB b2 ){
   return AABB( lower, upper );
 }
 
-struct PrimInfoExArgs{
-  int dim;
-  float pmid;
+// Read access for the binning to an array of PrimInfos
+struct PrimInfoView {
+  const PrimInfo *info;
+
+  float centroid( int i, int dim ) const { return info[i].centroid[dim]; }
+  const AABB &box( int i ) const { return info[i].box; }
+};
+
+// Input of the top-down builders. The centroids are stored per axis
+// and only the 32 bit indices into the arrays are partitioned, the
+// primitives are put in leaf order once the tree is built.
+struct BVHBuildPrims {
+  float *centroids[3];
+  AABB *boxes;
+  uint32 *prim;  // PrimInfo the entries of the arrays were made from
+  uint32 *index;
+
+  float centroid( int i, int dim ) const {
+    return centroids[dim][ index[i] ];
+  }
+  const AABB &box( int i ) const { return boxes[ index[i] ]; }
 };
 
-int mid_point_filter( void *x, void *ex_args ){
-  PrimInfo *pi = ( PrimInfo *)x;
-  PrimInfoExArgs *args = (PrimInfoExArgs *)ex_args;
-  return pi->centroid[ args->dim ] < args->pmid;
-}
 struct BVHNode{
   AABB box;
   BVHNode *left, *right; // NULL for leaf primitives
   int split_axis;
   int first_offset, num_prim; // only valid for leaf nodes
-  
+  float cost; // SAH cost of the subtree, see bvh_optimize()
 };
 
 BVHNode *bvh_create_leaf( Arena *arena, int first, int n, const AABB &bound){
   BVHNode *node = (BVHNode *)arena_alloc( arena, sizeof( BVHNode ), 8);
+  node->left = node->right = NULL;
+  node->split_axis = 0;
   node->first_offset = first;
   node->num_prim = n;
   node->box = bound;
@@ -642,513 +680,5588 @@ int get_max_bound_dim( const AABB &b ){
   else if ( diff.Y > diff.Z )
     return 1;
   else 
-    return 0;
+    return 2;
 }
 
-BVHNode *bvh_recursive_build(
-    Arena *arena,
-    PrimInfo *info,
+enum BVHBuilder {
+  BVH_BUILD_MIDPOINT, // centroid midpoint of the longest axis
+  BVH_BUILD_SAH,      // binned surface area heuristic
+  BVH_BUILD_LBVH,     // Morton code treelets joined by SAH, see lbvh_build()
+  BVH_BUILD_SBVH      // SAH with spatial splits, see sbvh_build()
+};
+
+struct BVHBuildOptions {
+  BVHBuilder builder;
+  int max_leaf_size; // SAH leaves never hold more unless they can't be split
+  int width;         // children per node used for rendering, 2, 4 or 8
+  bool refit;        // refit the previous scene's tree, see scene_update_bvh()
+  bool cache;        // keep the tree in <scene>.bvh, see bvh_cache_load()
+  float split_budget; // SBVH references added by splits, per primitive
+  bool quantize;     // compressed wide nodes, see BVHQuantNode
+  int optimize;      // treelet restructuring passes, see bvh_optimize()
+};
+
+BVHBuildOptions bvh_default_options( void ){
+  BVHBuildOptions opts;
+  opts.builder = BVH_BUILD_SAH;
+  opts.max_leaf_size = 4;
+  opts.width = 4;
+  opts.refit = false;
+  opts.cache = false;
+  opts.split_budget = 1.0f;
+  opts.quantize = false;
+  opts.optimize = 0;
+  return opts;
+}
+
+// Costs of the surface area heuristic relative to one primitive test
+#define BVH_SAH_BINS 16
+#define BVH_TRAVERSAL_COST 0.125f
+
+float AABB_surface_area( const AABB &b ){
+  v3 d = b.u - b.l;
+  if ( d.X < 0 || d.Y < 0 || d.Z < 0 ) return 0.0f; // empty box
+  return 2.0f * ( d.X * d.Y + d.Y * d.Z + d.Z * d.X );
+}
+
+struct SAHBin {
+  int count;
+  AABB box;
+};
+
+struct SAHSplit {
+  int dim;
+  int bin;     // primitives in bins [0,bin] go to the left
+  float cost;  // expected cost of the split, relative to one primitive test
+  float lo, scale; // bin = ( centroid - lo ) * scale
+};
+
+inline int sah_bin_index( float c, float lo, float scale ){
+  int b = (int)( ( c - lo ) * scale );
+  return CLAMP( b, 0, BVH_SAH_BINS - 1 );
+}
+
+inline bool sah_split_left( const SAHSplit &split, float centroid ){
+  return sah_bin_index( centroid, split.lo, split.scale ) <= split.bin;
+}
+
+// Bins the centroids along all three axes and evaluates the SAH cost
+// of the BVH_SAH_BINS - 1 planes between the bins of every axis
+template <typename Prims>
+SAHSplit sah_find_split(
+    const Prims &prims,
     int start,
     int end,
-    std::vector<PrimInfo> &ordered_prims )
+    const AABB &total_bound,
+    const AABB &centroid_bound )
 {
+  SAHSplit best = { -1, -1, FLT_MAX, 0.0f, 0.0f };
+  float inv_area = 1.0f / MAX( AABB_surface_area( total_bound ), 1e-12f );
+  // One pass over the primitives fills the bins of all the axes, an
+  // axis without extent puts everything in its first bin
+  float lo[3], scale[3];
+  SAHBin bins[3][ BVH_SAH_BINS ];
+  for ( int dim = 0; dim < 3; dim++ ){
+    lo[dim] = centroid_bound.l[dim];
+    float extent = centroid_bound.u[dim] - lo[dim];
+    scale[dim] = extent > 0.0f ? BVH_SAH_BINS / extent : 0.0f;
+    for ( int b = 0; b < BVH_SAH_BINS; b++ ){
+      bins[dim][b].count = 0;
+      bins[dim][b].box = AABB();
+    }
+  }
+  for ( int i = start; i < end; i++ ){
+    const AABB &box = prims.box( i );
+    for ( int dim = 0; dim < 3; dim++ ){
+      int b = sah_bin_index( prims.centroid( i, dim ), lo[dim], scale[dim] );
+      bins[dim][b].count++;
+      bins[dim][b].box = AABB_union( bins[dim][b].box, box );
+    }
+  }
 
-  AABB total_bound;
+  for ( int dim = 0; dim < 3; dim++ ){
+    if ( scale[dim] == 0.0f ) continue;
+    SAHBin *axis_bins = bins[dim];
+
+    // Sweep from the right to get the area and count right of every
+    // plane, then from the left evaluating the costs
+    float right_area[ BVH_SAH_BINS ];
+    int right_count[ BVH_SAH_BINS ];
+    AABB box;
+    int count = 0;
+    for ( int b = BVH_SAH_BINS - 1; b > 0; b-- ){
+      box = AABB_union( box, axis_bins[b].box );
+      count += axis_bins[b].count;
+      right_area[b] = AABB_surface_area( box );
+      right_count[b] = count;
+    }
+    box = AABB();
+    count = 0;
+    for ( int b = 0; b < BVH_SAH_BINS - 1; b++ ){
+      box = AABB_union( box, axis_bins[b].box );
+      count += axis_bins[b].count;
+      if ( count == 0 || right_count[b + 1] == 0 ) continue;
+      float cost = BVH_TRAVERSAL_COST +
+                   ( count * AABB_surface_area( box ) +
+                     right_count[b + 1] * right_area[b + 1] ) * inv_area;
+      if ( cost < best.cost ){
+        best = { dim, b, cost, lo[dim], scale[dim] };
+      }
+    }
+  }
+  return best;
+}
+
+// Splits prims[ start, end ) in place into [ start, mid ) and
+// [ mid, end ) and returns mid, or -1 when the range should become a
+// leaf. Leaves are never copied anywhere, the primitives of a leaf
+// are the ones left in its range once all the ranges are split, so
+// the offset of a leaf is its start.
+int bvh_split_range(
+    const BVHBuildPrims &prims,
+    int start,
+    int end,
+    const BVHBuildOptions &opts,
+    AABB &total_bound,
+    int &dim )
+{
+  total_bound = AABB();
+  AABB bounds;
   for ( int i = start; i < end; i++ ){
-    total_bound = AABB_union( total_bound, info[i].box );
+    total_bound = AABB_union( total_bound, prims.box( i ) );
+    bounds = AABB_union( bounds, v3{ prims.centroid( i, 0 ),
+                                     prims.centroid( i, 1 ),
+                                     prims.centroid( i, 2 ) } );
   }
   int len = end - start;
   if ( len == 1 ){
     // only a single primitive
-    BVHNode *n = bvh_create_leaf( arena, ordered_prims.size(),1,total_bound );
-    ordered_prims.push_back( info[start] );
-    return n;
+    return -1;
   }
 
-  AABB bounds; 
-  for ( int i = start ;i < end; i++ ){
-    bounds = AABB_union( bounds, info[i].centroid );
-  }
-  
-  int dim = get_max_bound_dim( bounds );
-  
+  dim = get_max_bound_dim( bounds );
+
   if ( bounds.l[ dim ] == bounds.u[dim] ){
     // Only one AABB exists, i.e. there are
     // a number of primitive with the same AABB
-    BVHNode *n = bvh_create_leaf( arena, ordered_prims.size(),len,total_bound );
-    for ( int i = start; i < end; i++ ){
-      ordered_prims.push_back( info[i] );
-    }
-    return n;
+    return -1;
   }
 
-  float pmid = 0.5f * ( bounds.l[dim] + bounds.u[dim] );
-  PrimInfoExArgs args = { dim, pmid };
-
-  int mid = start + partition(
-              (void *)(info + start),
-              len,
-              sizeof(*info),
-              mid_point_filter,
-              &args );
-  if ( mid == start || mid == end ){
-    // We were not able to find a good partition
-    BVHNode *n = bvh_create_leaf( arena, ordered_prims.size(),len,total_bound );
-    for ( int i = start; i < end; i++ ){
-      ordered_prims.push_back( info[i] );
+  int mid;
+  if ( opts.builder == BVH_BUILD_SAH ){
+    // Split only when it is expected to be cheaper than testing all
+    // the primitives, unless the leaf would be too big
+    SAHSplit split = sah_find_split( prims, start, end, total_bound, bounds );
+    if ( split.dim < 0 ||
+         ( split.cost >= len && len <= opts.max_leaf_size ) )
+    {
+      return -1;
     }
-    return n;
+    dim = split.dim;
+    const float *c = prims.centroids[ dim ];
+    mid = start + partition( prims.index + start, len,
+        [&]( uint32 i ){ return sah_split_left( split, c[i] ); } );
   } else {
-    BVHNode *l = bvh_recursive_build( arena, info, start, mid, ordered_prims);
-    BVHNode *r = bvh_recursive_build( arena, info, mid, end, ordered_prims);
-    return bvh_create_interior( arena, l, r, dim ); 
+    float pmid = 0.5f * ( bounds.l[dim] + bounds.u[dim] );
+    const float *c = prims.centroids[ dim ];
+    mid = start + partition( prims.index + start, len,
+        [&]( uint32 i ){ return c[i] < pmid; } );
+  }
+  if ( mid == start || mid == end ){
+    // We were not able to find a good partition
+    return -1;
   }
+  return mid;
 }
-    
 
-BVHNode *create_bvh_tree(
+BVHNode *bvh_recursive_build(
     Arena *arena,
-    const World &w,
-    std::vector<PrimInfo> &ordered_prims)
+    const BVHBuildPrims &prims,
+    int start,
+    int end,
+    const BVHBuildOptions &opts )
 {
-  std::vector<PrimInfo> prim;
-  for ( size_t i = 0; i < w.sph_count; i++ ){
-    prim.push_back(
-        PrimInfo( PrimInfo::SPHERE,
-          (void *)( w.spheres+i ),
-          sphere_aabb( *( w.spheres + i ) )
-        )
-    );
+  AABB total_bound;
+  int dim = 0;
+  int mid = bvh_split_range( prims, start, end, opts, total_bound, dim );
+  if ( mid < 0 ){
+    return bvh_create_leaf( arena, start, end - start, total_bound );
   }
+  BVHNode *l = bvh_recursive_build( arena, prims, start, mid, opts );
+  BVHNode *r = bvh_recursive_build( arena, prims, mid, end, opts );
+  return bvh_create_interior( arena, l, r, dim );
+}
 
-  for ( size_t i = 0; i < w.rect_count; i++ ){
-    prim.push_back(
-        PrimInfo( PrimInfo::RECTANGLE,
-          (void *)( w.rectangles+ i ),
-          rectangle_AABB( *(w.rectangles+i) ) )
-        );
-  }
-#if 0
-  for ( size_t i = 0; i < w.plane_count; i++ ){
-    prim.push_back(
-        PrimInfo( PrimInfo::PLANE,
-          (void *)( w.planes+i ),
-          (w.planes+i)->box
-          )
-    );
+// Ranges with fewer primitives are built by the task that reaches
+// them, larger ones are split and their halves handed to new tasks
+#define BVH_PARALLEL_MIN_PRIMS 4096
+
+struct BVHBuildContext {
+  BVHBuildPrims prims;
+  const BVHBuildOptions *opts;
+  ThreadPool *pool;
+  Arena *arenas; // one per worker of the pool, a task only uses its own
+  TaskGroup group;
+};
+
+struct BVHBuildTask {
+  BVHBuildContext *ctx;
+  int start, end;
+  BVHNode **node; // where the subtree is linked in
+};
+
+static void bvh_build_task( void *data, int worker ){
+  BVHBuildTask *t = ( BVHBuildTask *)data;
+  BVHBuildContext *ctx = t->ctx;
+  Arena *arena = ctx->arenas + worker;
+  if ( t->end - t->start < BVH_PARALLEL_MIN_PRIMS ){
+    *t->node = bvh_recursive_build( arena, ctx->prims, t->start, t->end,
+                                    *ctx->opts );
+    return;
   }
-  for ( size_t i = 0; i < w.rect_count; i++ ){
-    prim.push_back(
-        PrimInfo( PrimInfo::RECTANGLE,
-          (void *)( w.rects+i ),
-          (w.rects+i)->bounds
-          )
-    );
+
+  AABB total_bound;
+  int dim = 0;
+  int mid = bvh_split_range( ctx->prims, t->start, t->end, *ctx->opts,
+                             total_bound, dim );
+  if ( mid < 0 ){
+    *t->node = bvh_create_leaf( arena, t->start, t->end - t->start,
+                                total_bound );
+    return;
   }
-#endif
 
-  return bvh_recursive_build( arena, &prim[0], 0, prim.size(), ordered_prims );
+  // The children are linked in by their tasks. They are added to the
+  // group before this task finishes, so the group's pending count only
+  // drops to 0 once the whole tree is done.
+  BVHNode *node = (BVHNode *)arena_alloc( arena, sizeof( BVHNode ), 8);
+  node->num_prim = 0;
+  node->left = node->right = NULL;
+  node->split_axis = dim;
+  node->box = total_bound;
+  *t->node = node;
+
+  BVHBuildTask *children = ( BVHBuildTask *)arena_alloc(
+      arena, 2 * sizeof( BVHBuildTask ), 8 );
+  children[0] = { ctx, t->start, mid, &node->left };
+  children[1] = { ctx, mid, t->end, &node->right };
+  Task tasks[2] = {
+    { bvh_build_task, children + 0, NULL },
+    { bvh_build_task, children + 1, NULL }
+  };
+  thread_pool_submit( ctx->pool, tasks, 2, THREAD_POOL_PRIORITIES - 1,
+                      &ctx->group );
 }
 
-bool bvh_leaf_hit( 
-    BVHNode *node,
-    const Ray &r,
-    float tmin,
-    float tmax,
-    HitRecord &rec,
-    std::vector<PrimInfo> &ordered_prims)
-{
-  bool hit_anything = false;
-  HitRecord temp;
-  for ( int i = 0;
-        i < node->num_prim;
-        i++ )
-  {
-    PrimInfo &p = ordered_prims[ node->first_offset+ i];
-    switch ( p.type ){
-      case PrimInfo::SPHERE:
-        if( hit_sphere( *( (Sphere*)p.data), r, tmin, tmax, temp) ){
-          hit_anything = true;
-          tmax = temp.t;
-          rec = temp;
-        }
-        break;
-      case PrimInfo::PLANE:
-        if( hit_plane( *( (Plane*)p.data), r, tmin, tmax, temp) ){
-          hit_anything = true;
-          tmax = temp.t;
-          rec = temp;
-        }
-        break;
-      case PrimInfo::RECTANGLE:
-#if 0
-        if( hit_AARect( *( (AARect*)p.data), r, tmin, tmax, temp) ){
-          hit_anything = true;
-          tmax = temp.t;
-          rec = temp;
-        }
-#endif
-        if( hit_rect( *( (Rectangle *)p.data),
-              r, tmin, tmax, temp) )
-        {
-          hit_anything = true;
-          tmax = temp.t;
-          rec = temp;
-        }
-        break;
-      default:
-        break;
+// Runs the tasks on the pool and waits for them, or on the calling
+// thread as worker 0 without a pool
+static void bvh_run_tasks( ThreadPool *pool, Task *tasks, int count ){
+  if ( !pool ){
+    for ( int i = 0; i < count; i++ ){
+      tasks[i].func( tasks[i].data, 0 );
     }
+    return;
   }
-  return hit_anything;
+  TaskGroup group;
+  group.pending = 0;
+  thread_pool_submit( pool, tasks, count, THREAD_POOL_PRIORITIES - 1,
+                      &group );
+  thread_pool_wait_group( pool, &group );
 }
 
-bool bvh_traversal_hit( 
-    BVHNode *root,
-    const Ray &r,
-    float tmin,
-    float tmax,
-    HitRecord &rec,
-    std::vector<PrimInfo> &ordered_prims)
-{
-  if ( AABB_hit( root->box, r, tmin, tmax ) ){
-    HitRecord lrec , rrec;
-    bool lhit, rhit;
-    if ( root->num_prim > 0 ){
-      // we are in a leaf node
-      return bvh_leaf_hit( root,r, tmin, tmax,rec, ordered_prims );
-    } else {
-      lhit = bvh_traversal_hit( root->left,
-              r, tmin, tmax ,lrec,ordered_prims );
-      rhit = bvh_traversal_hit( root->right,
-              r,tmin,tmax,rrec,ordered_prims );
-    }
+// Linear BVH ( HLBVH ). The primitives are sorted along a Morton curve
+// through their centroids, runs sharing the top LBVH_TREELET_BITS bits
+// of the code become treelets split at the bits where the codes
+// change, and the treelets are joined by a SAH build. Apart from the
+// few top levels this takes linear time.
+#define MORTON_BITS 10 // per axis, 30 bit codes
+#define LBVH_TREELET_BITS 12
+#define RADIX_BITS 6
+#define RADIX_BUCKETS ( 1 << RADIX_BITS )
 
-    if ( lhit && rhit ){
-      if ( lrec.t < rrec.t ) 
-        rec = lrec;
-      else rec = rrec;
-      return true;
-    } else if ( lhit ){
-      rec = lrec;
-      return true;
-    } else if ( rhit ){
-      rec = rrec;
-      return true;
-    } 
-  } 
-  return false;
+struct MortonPrim {
+  uint32 code;
+  int index; // into the unsorted PrimInfo array
+};
+
+// Spreads the lower 10 bits of x to every third bit
+inline uint32 left_shift3( uint32 x ){
+  if ( x == ( 1 << 10 ) ) --x;
+  x = ( x | ( x << 16 ) ) & 0x030000ff;
+  x = ( x | ( x <<  8 ) ) & 0x0300f00f;
+  x = ( x | ( x <<  4 ) ) & 0x030c30c3;
+  x = ( x | ( x <<  2 ) ) & 0x09249249;
+  return x;
 }
-v3 get_ray_color(
-    BVHNode *root,
-    const Ray &ray,
-    int depth,
-    std::vector<PrimInfo> &ordered_prims )
-{
-  v3 direction = HMM_NormalizeVec3( ray.direction );
-  
-  HitRecord rec;
-  v3 attn;
-  Ray out;
 
-  if ( bvh_traversal_hit( root, ray,0.001f,FLT_MAX, rec,ordered_prims ) ){
-    v3 emitted = { 0.0f, 0.0f, 0.0f };
-    switch ( rec.m->type ){
-      case MATERIAL_DIFFUSE_LIGHT: 
-        return rec.m->diff_light_color;
-      case MATERIAL_SPOT_LIGHT: {
-        if ( depth == 0 ) return rec.m->spot_light_color; 
-        float x= MAX(-HMM_DotVec3(
-              HMM_NormalizeVec3(ray.direction),
-              rec.n ), 0 );
-        if ( x > rec.m->angle )
-          return rec.m->spot_light_color;
-        else
-          return HMM_PowerF(x,4) * rec.m->spot_light_color;
-        break;
-      }
-      default:
-        break;
-    }
-    if ( rec.m->scatter( rec, ray, attn, out ) && ( depth < 30 ) ){
-        return attn * get_ray_color( root, out, depth+1,ordered_prims );
-    } else if ( depth >= 30  ){
-      Texture *t = rec.m->albedo;
-      emitted = t->get_color( t, 0,0, rec.p );
+// Bit 3k of the code is a bit of x, 3k+1 of y and 3k+2 of z, so the
+// axis a bit splits is its index modulo 3
+inline uint32 encode_morton3( const v3 &v ){
+  return ( left_shift3( (uint32)v.Z ) << 2 ) |
+         ( left_shift3( (uint32)v.Y ) << 1 ) |
+           left_shift3( (uint32)v.X );
+}
+
+struct MortonSort {
+  const PrimInfo *info;
+  AABB centroid_bound;
+  MortonPrim *prims, *temp;
+  int count;
+  int chunk_size, chunk_count;
+  int shift; // of the digit sorted by the current pass
+  int (*offsets)[ RADIX_BUCKETS ]; // per chunk, see morton_sort()
+};
+
+struct MortonChunk {
+  MortonSort *sort;
+  int chunk;
+};
+
+static void morton_code_task( void *data, int ){
+  MortonChunk *c = ( MortonChunk *)data;
+  MortonSort *s = c->sort;
+  int start = c->chunk * s->chunk_size;
+  int end = MIN( start + s->chunk_size, s->count );
+  v3 lo = s->centroid_bound.l;
+  v3 extent = s->centroid_bound.u - lo;
+  for ( int i = start; i < end; i++ ){
+    v3 off = s->info[i].centroid - lo;
+    for ( int k = 0; k < 3; k++ ){
+      off[k] = extent[k] > 0 ? off[k] / extent[k] : 0.0f;
     }
-    return emitted;
+    s->prims[i].code = encode_morton3( off * (float)( 1 << MORTON_BITS ) );
+    s->prims[i].index = i;
   }
-#if 0    
-    float t = 0.5f * ( direction.Y + 1.0f );
-    
-    v3 start= { 1.0f, 1.0f, 1.0f };
-    v3 end = { 0.5f, 0.7f, 1.0f };
-    return ( 1.0 - t ) * start + t * end;
-#else
-    return v3{0.0f,0.0f,0.0f};
-#endif
 }
 
-
-void print_aabb( const AABB &b ){
-  fprintf( stdout, "Max. bound: " );
-  print_v3( b.u );
-  fprintf( stdout,"\nMin. bound: " );
-  print_v3( b.l );
+static void radix_count_task( void *data, int ){
+  MortonChunk *c = ( MortonChunk *)data;
+  MortonSort *s = c->sort;
+  int start = c->chunk * s->chunk_size;
+  int end = MIN( start + s->chunk_size, s->count );
+  int *counts = s->offsets[ c->chunk ];
+  memset( counts, 0, RADIX_BUCKETS * sizeof( int ) );
+  for ( int i = start; i < end; i++ ){
+    counts[ ( s->prims[i].code >> s->shift ) & ( RADIX_BUCKETS - 1 ) ]++;
+  }
 }
 
-void print_bvh_info( BVHNode *node ){
-struct BVHNode{
-  AABB box;
-  BVHNode *left, *right; // NULL for leaf primitives
-  int split_axis;
-  int first_offset, num_prim; // only valid for leaf nodes
-  
-};
-  fprintf(stdout,"The bounding box is: \n" );
-  print_aabb( node->box );
-  fprintf( stdout, "\n" );
-  if ( node->num_prim > 0 ){
-    fprintf( stdout,"leaf node with %d primitives, starting at %d.\n",
-            node->num_prim, node->first_offset );
-  } else {
-    fprintf( stdout, "Interior node\n" );
+static void radix_scatter_task( void *data, int ){
+  MortonChunk *c = ( MortonChunk *)data;
+  MortonSort *s = c->sort;
+  int start = c->chunk * s->chunk_size;
+  int end = MIN( start + s->chunk_size, s->count );
+  int *offsets = s->offsets[ c->chunk ];
+  for ( int i = start; i < end; i++ ){
+    uint32 digit = ( s->prims[i].code >> s->shift ) & ( RADIX_BUCKETS - 1 );
+    s->temp[ offsets[ digit ]++ ] = s->prims[i];
   }
 }
 
-void bvh_tree_print( BVHNode *node ){
-  print_bvh_info( node );
-  fprintf(stdout,"========================================\n");
-  if(node->left){
-    fprintf(stdout,"Left Node:\n");
-    bvh_tree_print( node->left ); 
-    fprintf(stdout,"-----------------------------------------\n");
+// Computes the codes and sorts them with a least significant digit
+// radix sort. Every pass counts the digits of each chunk in parallel,
+// turns the counts into the chunk's first slot for every digit, bucket
+// by bucket and chunk by chunk, and scatters the chunks in parallel.
+// Returns the sorted array, allocated from arena.
+MortonPrim *morton_sort(
+    Arena *arena,
+    ThreadPool *pool,
+    const PrimInfo *info,
+    int count )
+{
+  MortonSort s;
+  s.info = info;
+  s.count = count;
+  for ( int i = 0; i < count; i++ ){
+    s.centroid_bound = AABB_union( s.centroid_bound, info[i].centroid );
   }
-  if(node->right){
-    fprintf(stdout,"Right Node:\n");
-    bvh_tree_print( node->right );
-    fprintf(stdout,"-----------------------------------------\n");
+  s.prims = ( MortonPrim *)arena_alloc( arena, count * sizeof( MortonPrim ),
+                                        16 );
+  s.temp = ( MortonPrim *)arena_alloc( arena, count * sizeof( MortonPrim ),
+                                       16 );
+  int workers = pool ? pool->thread_count : 1;
+  s.chunk_count = MIN( 4 * workers, MAX( count / 1024, 1 ) );
+  s.chunk_size = ( count + s.chunk_count - 1 ) / s.chunk_count;
+  s.offsets = ( int (*)[ RADIX_BUCKETS ])arena_alloc(
+      arena, s.chunk_count * sizeof( *s.offsets ), 16 );
+
+  MortonChunk *chunks = ( MortonChunk *)arena_alloc(
+      arena, s.chunk_count * sizeof( MortonChunk ), 8 );
+  Task *tasks = ( Task *)arena_alloc( arena, s.chunk_count * sizeof( Task ),
+                                      8 );
+  for ( int c = 0; c < s.chunk_count; c++ ){
+    chunks[c] = { &s, c };
+    tasks[c] = { morton_code_task, chunks + c, NULL };
   }
+  bvh_run_tasks( pool, tasks, s.chunk_count );
+
+  for ( s.shift = 0; s.shift < 3 * MORTON_BITS; s.shift += RADIX_BITS ){
+    for ( int c = 0; c < s.chunk_count; c++ ){
+      tasks[c].func = radix_count_task;
+    }
+    bvh_run_tasks( pool, tasks, s.chunk_count );
+    int next = 0;
+    for ( int b = 0; b < RADIX_BUCKETS; b++ ){
+      for ( int c = 0; c < s.chunk_count; c++ ){
+        int n = s.offsets[c][b];
+        s.offsets[c][b] = next;
+        next += n;
+      }
+    }
+    for ( int c = 0; c < s.chunk_count; c++ ){
+      tasks[c].func = radix_scatter_task;
+    }
+    bvh_run_tasks( pool, tasks, s.chunk_count );
+    MortonPrim *t = s.prims;
+    s.prims = s.temp;
+    s.temp = t;
+  }
+  return s.prims;
 }
 
-void print_sphere_info( Sphere *sph ){
-  fprintf(stdout,"Center: ");
+// Splits [ start, end ) of the sorted primitives where the given bit
+// of the codes changes, lower bits are tried when it doesn't change
+// within the range
+BVHNode *lbvh_emit(
+    Arena *arena,
+    const PrimInfo *info,
+    const MortonPrim *prims,
+    int start,
+    int end,
+    int bit,
+    const BVHBuildOptions &opts )
+{
+  int len = end - start;
+  int mid = -1;
+  for ( ; len > opts.max_leaf_size && bit >= 0; bit-- ){
+    uint32 mask = 1u << bit;
+    if ( ( prims[ start ].code & mask ) == ( prims[ end - 1 ].code & mask ) ){
+      continue;
+    }
+    // first primitive with the bit set
+    int lo = start, hi = end - 1;
+    while ( lo + 1 < hi ){
+      int m = ( lo + hi ) / 2;
+      if ( prims[m].code & mask ) hi = m;
+      else lo = m;
+    }
+    mid = hi;
+    break;
+  }
+  if ( mid < 0 && len > opts.max_leaf_size ){
+    // identical codes, halve the range to keep the leaves small
+    mid = start + len / 2;
+    bit = 0;
+  }
+  if ( mid < 0 ){
+    AABB box;
+    for ( int i = start; i < end; i++ ){
+      box = AABB_union( box, info[i].box );
+    }
+    return bvh_create_leaf( arena, start, len, box );
+  }
+  BVHNode *l = lbvh_emit( arena, info, prims, start, mid, bit - 1, opts );
+  BVHNode *r = lbvh_emit( arena, info, prims, mid, end, bit - 1, opts );
+  return bvh_create_interior( arena, l, r, bit % 3 );
+}
+
+struct LBVHTreelet {
+  const PrimInfo *info;
+  const MortonPrim *prims;
+  const BVHBuildOptions *opts;
+  Arena *arenas;
+  int start, end;
+  BVHNode *root;
+};
+
+static void lbvh_treelet_task( void *data, int worker ){
+  LBVHTreelet *t = ( LBVHTreelet *)data;
+  t->root = lbvh_emit( t->arenas + worker, t->info, t->prims,
+                       t->start, t->end,
+                       3 * MORTON_BITS - LBVH_TREELET_BITS - 1, *t->opts );
+}
+
+// SAH build over the treelet roots, held in PrimInfos whose data is
+// the root node. Every treelet ends up in its own subtree, so the
+// split is forced whenever the SAH finds none.
+BVHNode *lbvh_build_upper(
+    Arena *arena,
+    PrimInfo *roots,
+    int start,
+    int end )
+{
+  if ( end - start == 1 ) return ( BVHNode *)roots[ start ].data;
+  AABB total_bound, bounds;
+  for ( int i = start; i < end; i++ ){
+    total_bound = AABB_union( total_bound, roots[i].box );
+    bounds = AABB_union( bounds, roots[i].centroid );
+  }
+  SAHSplit split = sah_find_split( PrimInfoView{ roots }, start, end,
+                                   total_bound, bounds );
+  int dim = 0;
+  int mid = -1;
+  if ( split.dim >= 0 ){
+    dim = split.dim;
+    mid = start + partition( roots + start, end - start,
+        [&]( const PrimInfo &p ){
+          return sah_split_left( split, p.centroid[ dim ] );
+        } );
+  }
+  if ( mid <= start || mid >= end ) mid = ( start + end ) / 2;
+  BVHNode *l = lbvh_build_upper( arena, roots, start, mid );
+  BVHNode *r = lbvh_build_upper( arena, roots, mid, end );
+  return bvh_create_interior( arena, l, r, dim );
+}
+
+// Sorts prim along the Morton curve and returns the tree over it, the
+// leaves refer to the sorted order
+BVHNode *lbvh_build(
+    Arena *arenas,
+    ThreadPool *pool,
+    std::vector<PrimInfo> &prim,
+    const BVHBuildOptions &opts )
+{
+  int count = prim.size();
+  MortonPrim *prims = morton_sort( arenas, pool, &prim[0], count );
+  std::vector<PrimInfo> sorted;
+  sorted.reserve( count );
+  for ( int i = 0; i < count; i++ ){
+    sorted.push_back( prim[ prims[i].index ] );
+  }
+  prim.swap( sorted );
+
+  uint32 mask = ~0u << ( 3 * MORTON_BITS - LBVH_TREELET_BITS );
+  std::vector<LBVHTreelet> treelets;
+  for ( int start = 0, end = 1; end <= count; end++ ){
+    if ( end == count ||
+         ( prims[ start ].code & mask ) != ( prims[ end ].code & mask ) )
+    {
+      treelets.push_back( { &prim[0], prims, &opts, arenas, start, end,
+                            NULL } );
+      start = end;
+    }
+  }
+  std::vector<Task> tasks( treelets.size() );
+  for ( size_t i = 0; i < treelets.size(); i++ ){
+    tasks[i] = { lbvh_treelet_task, &treelets[i], NULL };
+  }
+  bvh_run_tasks( pool, &tasks[0], tasks.size() );
+
+  std::vector<PrimInfo> roots;
+  roots.reserve( treelets.size() );
+  for ( const LBVHTreelet &t : treelets ){
+    roots.push_back( PrimInfo( PrimInfo::SPHERE, t.root, t.root->box ) );
+  }
+  return lbvh_build_upper( arenas, &roots[0], 0, roots.size() );
+}
+
+// Spatial split BVH ( SBVH ). Besides the binned object split every
+// node also tries splitting space itself when the two children of the
+// object split overlap much: references straddling the plane go to
+// both sides, each clipped to its half. Large rectangles then end up
+// in several small leaves instead of inflating the boxes of the whole
+// tree. The leaves hold copies of the PrimInfos, so one primitive can
+// be referenced several times from ordered_prims.
+
+// Spatial splits are only tried when the object split's children
+// overlap by more than this fraction of the root's surface area
+#define SBVH_OVERLAP_ALPHA 1e-5f
+// Keeps the tree well within the traversal stack
+#define SBVH_MAX_SPATIAL_DEPTH 40
+
+// Part of the reference's box between lo and hi along dim. The part of
+// a rectangle is clipped exactly, padded like rectangle_AABB() and
+// slightly grown so rounding in the clip can't leave a gap at the
+// plane. Returns an empty box when nothing of it is inside.
+AABB sbvh_clip( const PrimInfo &ref, int dim, float lo, float hi ){
+  AABB box = ref.box;
+  box.l[dim] = MAX( box.l[dim], lo );
+  box.u[dim] = MIN( box.u[dim], hi );
+  if ( box.l[dim] > box.u[dim] ) return AABB();
+  if ( ref.type != PrimInfo::RECTANGLE ) return box;
+
+  const Rectangle *rect = ( const Rectangle *)ref.data;
+  v3 poly[8] = { rect->p0, rect->p1, rect->p2, rect->p3 };
+  int count = 4;
+  // Sutherland-Hodgman against the two planes
+  for ( int side = 0; side < 2; side++ ){
+    v3 clipped[8];
+    int n = 0;
+    float plane = side ? hi : lo;
+    for ( int i = 0; i < count; i++ ){
+      const v3 &a = poly[i];
+      const v3 &b = poly[ ( i + 1 ) % count ];
+      float da = side ? plane - a[dim] : a[dim] - plane;
+      float db = side ? plane - b[dim] : b[dim] - plane;
+      if ( da >= 0 ) clipped[ n++ ] = a;
+      if ( ( da < 0 ) != ( db < 0 ) ){
+        clipped[ n++ ] = a + ( da / ( da - db ) ) * ( b - a );
+      }
+    }
+    count = n;
+    memcpy( poly, clipped, n * sizeof( v3 ) );
+  }
+  if ( count == 0 ) return AABB();
+
+  AABB clip;
+  for ( int i = 0; i < count; i++ ){
+    clip = AABB_union( clip, poly[i] );
+  }
+  v3 extent = ref.box.u - ref.box.l;
+  float eps = 1e-4f * MAX( extent.X, MAX( extent.Y, extent.Z ) );
+  for ( int k = 0; k < 3; k++ ){
+    float pad = clip.u[k] - clip.l[k] < TOLERANCE ? 0.01f : eps;
+    box.l[k] = MAX( box.l[k], clip.l[k] - pad );
+    box.u[k] = MIN( box.u[k], clip.u[k] + pad );
+  }
+  return box;
+}
+
+struct SBVHSpatialSplit {
+  int dim;
+  int bin;    // the plane is the upper side of this bin
+  float cost;
+  float lo, step;
+};
+
+inline int sbvh_bin_index( float x, float lo, float step ){
+  int b = (int)( ( x - lo ) / step );
+  return CLAMP( b, 0, BVH_SAH_BINS - 1 );
+}
+
+// Bins the references over the node's box, every reference clipped to
+// every bin it touches. A reference is counted on the left of the
+// planes from its first bin and on the right of those before its last,
+// so straddling references count on both sides.
+SBVHSpatialSplit sbvh_find_spatial_split(
+    const std::vector<PrimInfo> &refs,
+    const AABB &box )
+{
+  SBVHSpatialSplit best = { -1, -1, FLT_MAX, 0.0f, 0.0f };
+  float inv_area = 1.0f / MAX( AABB_surface_area( box ), 1e-12f );
+  for ( int dim = 0; dim < 3; dim++ ){
+    float lo = box.l[dim];
+    float step = ( box.u[dim] - lo ) / BVH_SAH_BINS;
+    if ( step <= 0.0f ) continue;
+
+    AABB bins[ BVH_SAH_BINS ];
+    int entry[ BVH_SAH_BINS ] = {}, exit[ BVH_SAH_BINS ] = {};
+    for ( const PrimInfo &ref : refs ){
+      int b0 = sbvh_bin_index( ref.box.l[dim], lo, step );
+      int b1 = sbvh_bin_index( ref.box.u[dim], lo, step );
+      entry[ b0 ]++;
+      exit[ b1 ]++;
+      for ( int b = b0; b <= b1; b++ ){
+        float hi = b == BVH_SAH_BINS - 1 ? box.u[dim] : lo + ( b + 1 ) * step;
+        bins[b] = AABB_union( bins[b],
+                              sbvh_clip( ref, dim, lo + b * step, hi ) );
+      }
+    }
+
+    float right_area[ BVH_SAH_BINS ];
+    int right_count[ BVH_SAH_BINS ];
+    AABB acc;
+    int count = 0;
+    for ( int b = BVH_SAH_BINS - 1; b > 0; b-- ){
+      acc = AABB_union( acc, bins[b] );
+      count += exit[b];
+      right_area[b] = AABB_surface_area( acc );
+      right_count[b] = count;
+    }
+    acc = AABB();
+    count = 0;
+    for ( int b = 0; b < BVH_SAH_BINS - 1; b++ ){
+      acc = AABB_union( acc, bins[b] );
+      count += entry[b];
+      if ( count == 0 || right_count[b + 1] == 0 ) continue;
+      float cost = BVH_TRAVERSAL_COST +
+                   ( count * AABB_surface_area( acc ) +
+                     right_count[b + 1] * right_area[b + 1] ) * inv_area;
+      if ( cost < best.cost ){
+        best = { dim, b, cost, lo, step };
+      }
+    }
+  }
+  return best;
+}
+
+struct SBVHBuilder {
+  Arena *arena;
+  const BVHBuildOptions *opts;
+  std::vector<PrimInfo> out; // the references of the leaves, in order
+  int budget;                // references splits may still add
+  float root_area;
+};
+
+static BVHNode *sbvh_build_node(
+    SBVHBuilder &b,
+    std::vector<PrimInfo> &refs,
+    int depth )
+{
+  int len = refs.size();
+  AABB box, bounds;
+  for ( const PrimInfo &ref : refs ){
+    box = AABB_union( box, ref.box );
+    bounds = AABB_union( bounds, ref.centroid );
+  }
+  if ( depth == 0 ) b.root_area = MAX( AABB_surface_area( box ), 1e-12f );
+
+  SAHSplit object = { -1, -1, FLT_MAX, 0.0f, 0.0f };
+  SBVHSpatialSplit spatial = { -1, -1, FLT_MAX, 0.0f, 0.0f };
+  if ( len > 1 ){
+    object = sah_find_split( PrimInfoView{ &refs[0] }, 0, len, box, bounds );
+    float overlap = 0.0f;
+    if ( object.dim >= 0 ){
+      AABB l, r;
+      for ( const PrimInfo &ref : refs ){
+        if ( sah_split_left( object, ref.centroid[ object.dim ] ) ){
+          l = AABB_union( l, ref.box );
+        } else {
+          r = AABB_union( r, ref.box );
+        }
+      }
+      AABB both( v3{ MAX( l.l.X, r.l.X ), MAX( l.l.Y, r.l.Y ),
+                     MAX( l.l.Z, r.l.Z ) },
+                 v3{ MIN( l.u.X, r.u.X ), MIN( l.u.Y, r.u.Y ),
+                     MIN( l.u.Z, r.u.Z ) } );
+      overlap = AABB_surface_area( both );
+    }
+    if ( b.budget > 0 && depth < SBVH_MAX_SPATIAL_DEPTH &&
+         ( object.dim < 0 || overlap > SBVH_OVERLAP_ALPHA * b.root_area ) )
+    {
+      spatial = sbvh_find_spatial_split( refs, box );
+    }
+  }
+
+  bool use_spatial = spatial.dim >= 0 && spatial.cost < object.cost;
+  float cost = use_spatial ? spatial.cost : object.cost;
+  if ( ( !use_spatial && object.dim < 0 ) ||
+       ( cost >= len && len <= b.opts->max_leaf_size ) )
+  {
+    int first = b.out.size();
+    b.out.insert( b.out.end(), refs.begin(), refs.end() );
+    return bvh_create_leaf( b.arena, first, len, box );
+  }
+
+  std::vector<PrimInfo> left, right;
+  int dim;
+  if ( use_spatial ){
+    dim = spatial.dim;
+    float plane = spatial.lo + ( spatial.bin + 1 ) * spatial.step;
+    int added = 0;
+    for ( const PrimInfo &ref : refs ){
+      int b0 = sbvh_bin_index( ref.box.l[dim], spatial.lo, spatial.step );
+      int b1 = sbvh_bin_index( ref.box.u[dim], spatial.lo, spatial.step );
+      if ( b1 <= spatial.bin ){
+        left.push_back( ref );
+      } else if ( b0 > spatial.bin ){
+        right.push_back( ref );
+      } else {
+        AABB lbox = sbvh_clip( ref, dim, -FLT_MAX, plane );
+        AABB rbox = sbvh_clip( ref, dim, plane, FLT_MAX );
+        bool in_left = lbox.l[dim] <= lbox.u[dim];
+        bool in_right = rbox.l[dim] <= rbox.u[dim];
+        if ( in_left ) left.push_back( PrimInfo( ref.type, ref.data, lbox ) );
+        if ( in_right ) right.push_back( PrimInfo( ref.type, ref.data, rbox ) );
+        added += in_left && in_right;
+      }
+    }
+    b.budget -= added;
+    use_spatial = !left.empty() && !right.empty() &&
+                  ( (int)left.size() < len || (int)right.size() < len );
+    if ( !use_spatial ){
+      left.clear();
+      right.clear();
+      b.budget += added;
+      if ( object.dim < 0 ){
+        int first = b.out.size();
+        b.out.insert( b.out.end(), refs.begin(), refs.end() );
+        return bvh_create_leaf( b.arena, first, len, box );
+      }
+    }
+  }
+  if ( !use_spatial ){
+    dim = object.dim;
+    int mid = partition( &refs[0], len,
+        [&]( const PrimInfo &p ){
+          return sah_split_left( object, p.centroid[ dim ] );
+        } );
+    if ( mid == 0 || mid == len ){
+      int first = b.out.size();
+      b.out.insert( b.out.end(), refs.begin(), refs.end() );
+      return bvh_create_leaf( b.arena, first, len, box );
+    }
+    left.assign( refs.begin(), refs.begin() + mid );
+    right.assign( refs.begin() + mid, refs.end() );
+  }
+  std::vector<PrimInfo>().swap( refs );
+  BVHNode *l = sbvh_build_node( b, left, depth + 1 );
+  BVHNode *r = sbvh_build_node( b, right, depth + 1 );
+  return bvh_create_interior( b.arena, l, r, dim );
+}
+
+// Builds on the calling thread, prim is replaced by the references of
+// the leaves
+BVHNode *sbvh_build(
+    Arena *arena,
+    std::vector<PrimInfo> &prim,
+    const BVHBuildOptions &opts )
+{
+  SBVHBuilder b;
+  b.arena = arena;
+  b.opts = &opts;
+  b.budget = (int)( opts.split_budget * prim.size() );
+  b.root_area = 1.0f;
+  b.out.reserve( prim.size() + b.budget );
+  std::vector<PrimInfo> refs( prim );
+  BVHNode *root = sbvh_build_node( b, refs, 0 );
+  prim.swap( b.out );
+  return root;
+}
+
+// The tree laid out depth first in one array, so the first child of
+// an interior node is the node right after it and only the offset of
+// the second child is stored. Two nodes fit in a cache line.
+struct LinearBVHNode {
+  AABB box;
+  union {
+    int first_offset;  // leaf
+    int second_child;  // interior
+  };
+  uint16_t num_prim;   // 0 for interior nodes
+  uint8 split_axis;
+  uint8 pad;
+};
+static_assert( sizeof( LinearBVHNode ) == 32, "LinearBVHNode is not 32 bytes" );
+
+// Max. depth of the trees the traversal stack can hold
+#define BVH_STACK_SIZE 64
+
+int bvh_count_nodes( const BVHNode *node ){
+  if ( node->num_prim > 0 ) return 1;
+  return 1 + bvh_count_nodes( node->left ) + bvh_count_nodes( node->right );
+}
+
+static int bvh_flatten_node(
+    const BVHNode *node,
+    LinearBVHNode *nodes,
+    int &next,
+    int depth )
+{
+  assert( depth < BVH_STACK_SIZE );
+  int index = next++;
+  LinearBVHNode *ln = nodes + index;
+  ln->box = node->box;
+  ln->split_axis = node->split_axis;
+  ln->pad = 0;
+  if ( node->num_prim > 0 ){
+    assert( node->num_prim <= UINT16_MAX );
+    ln->first_offset = node->first_offset;
+    ln->num_prim = node->num_prim;
+  } else {
+    ln->num_prim = 0;
+    bvh_flatten_node( node->left, nodes, next, depth + 1 );
+    ln->second_child = bvh_flatten_node( node->right, nodes, next,
+                                         depth + 1 );
+  }
+  return index;
+}
+
+// Leaves hold at most this many primitives, the range of num_prim
+#define BVH_MAX_LEAF_PRIMS UINT16_MAX
+// Subtrees this deep are rebuilt balanced when they would overflow
+// the traversal stacks
+#define BVH_BALANCE_DEPTH ( BVH_STACK_SIZE / 2 )
+
+struct BVHLeafPiece {
+  AABB box;
+  int first, count;
+};
+
+static int bvh_leaf_pieces( const BVHNode *leaf ){
+  return ( leaf->num_prim + BVH_MAX_LEAF_PRIMS - 1 ) / BVH_MAX_LEAF_PRIMS;
+}
+
+// Levels below node once its leaves are split to BVH_MAX_LEAF_PRIMS
+static int bvh_height( const BVHNode *node ){
+  if ( node->num_prim > 0 ){
+    int h = 0;
+    while ( ( 1 << h ) < bvh_leaf_pieces( node ) ) h++;
+    return h;
+  }
+  int l = bvh_height( node->left );
+  int r = bvh_height( node->right );
+  return 1 + MAX( l, r );
+}
+
+static void bvh_gather_pieces(
+    const BVHNode *node,
+    std::vector<BVHLeafPiece> &pieces )
+{
+  if ( node->num_prim > 0 ){
+    for ( int i = 0; i < node->num_prim; i += BVH_MAX_LEAF_PRIMS ){
+      pieces.push_back( { node->box, node->first_offset + i,
+                          MIN( node->num_prim - i, BVH_MAX_LEAF_PRIMS ) } );
+    }
+    return;
+  }
+  bvh_gather_pieces( node->left, pieces );
+  bvh_gather_pieces( node->right, pieces );
+}
+
+// Splits the pieces in halves at the median centroid along the longest
+// axis, so the tree is ceil( log2( count ) ) levels high
+static BVHNode *bvh_build_balanced(
+    Arena *arena,
+    BVHLeafPiece *pieces,
+    int count )
+{
+  if ( count == 1 ){
+    return bvh_create_leaf( arena, pieces[0].first, pieces[0].count,
+                            pieces[0].box );
+  }
+  AABB bounds;
+  for ( int i = 0; i < count; i++ ){
+    bounds = AABB_union( bounds, 0.5f * ( pieces[i].box.l + pieces[i].box.u ) );
+  }
+  int dim = get_max_bound_dim( bounds );
+  int mid = count / 2;
+  std::nth_element( pieces, pieces + mid, pieces + count,
+      [dim]( const BVHLeafPiece &a, const BVHLeafPiece &b ){
+        return a.box.l[dim] + a.box.u[dim] < b.box.l[dim] + b.box.u[dim];
+      } );
+  BVHNode *l = bvh_build_balanced( arena, pieces, mid );
+  BVHNode *r = bvh_build_balanced( arena, pieces + mid, count - mid );
+  return bvh_create_interior( arena, l, r, dim );
+}
+
+// Degenerate scenes can make any builder exceed BVH_STACK_SIZE levels,
+// like the midpoint split of exponentially spaced primitives or piles
+// of spatial splits, and many identical primitives end up in one leaf.
+// Subtrees at BVH_BALANCE_DEPTH that would reach the limit, and leaves
+// that are too big, are rebuilt balanced over their leaves split to
+// BVH_MAX_LEAF_PRIMS. That takes at most 31 more levels.
+static BVHNode *bvh_limit_depth( Arena *arena, BVHNode *node, int depth ){
+  if ( node->num_prim > BVH_MAX_LEAF_PRIMS ||
+       ( depth == BVH_BALANCE_DEPTH &&
+         depth + bvh_height( node ) >= BVH_STACK_SIZE ) )
+  {
+    std::vector<BVHLeafPiece> pieces;
+    bvh_gather_pieces( node, pieces );
+    return bvh_build_balanced( arena, &pieces[0], pieces.size() );
+  }
+  if ( node->num_prim > 0 ) return node;
+  node->left = bvh_limit_depth( arena, node->left, depth + 1 );
+  node->right = bvh_limit_depth( arena, node->right, depth + 1 );
+  return node;
+}
+
+// Returns the nodes allocated from arena, the root is the first one
+LinearBVHNode *bvh_flatten( Arena *arena, const BVHNode *root, int *count ){
+  *count = bvh_count_nodes( root );
+  LinearBVHNode *nodes = ( LinearBVHNode *)arena_alloc(
+      arena, *count * sizeof( LinearBVHNode ), 32 );
+  int next = 0;
+  bvh_flatten_node( root, nodes, next, 0 );
+  assert( next == *count );
+  return nodes;
+}
+
+// Treelet restructuring ( Karras and Aila, "Fast Parallel Construction
+// of High-Quality Bounding Volume Hierarchies" ). Bottom-up, every
+// interior node grows a treelet by opening its largest leaf until it
+// has BVH_TREELET_LEAVES of them, the leaves being whole subtrees. A
+// dynamic program over the subsets of the leaves finds the topology of
+// least SAH cost, which is rebuilt from the treelet's interior nodes.
+#define BVH_TREELET_LEAVES 7
+
+struct BVHTreelet {
+  BVHNode *leaves[ BVH_TREELET_LEAVES ];
+  BVHNode *interior[ BVH_TREELET_LEAVES - 1 ];
+  int leaf_count;
+  int interior_count;
+  int next_interior;
+  AABB box[ 1 << BVH_TREELET_LEAVES ];
+  float cost[ 1 << BVH_TREELET_LEAVES ];
+  uint8 split[ 1 << BVH_TREELET_LEAVES ]; // subset of the first child
+};
+
+// Orders the children as the binary traversal expects, the one with
+// the lower centroid along the axis they are farthest apart first
+static void bvh_order_children( BVHNode *node ){
+  // Twice the centroids, only the sign and order matter
+  v3 d = ( node->right->box.l + node->right->box.u ) -
+         ( node->left->box.l + node->left->box.u );
+  int axis = 0;
+  for ( int k = 1; k < 3; k++ ){
+    if ( fabsf( d[k] ) > fabsf( d[axis] ) ) axis = k;
+  }
+  if ( d[axis] < 0 ) std::swap( node->left, node->right );
+  node->split_axis = axis;
+}
+
+static void bvh_node_cost( BVHNode *node ){
+  float area = AABB_surface_area( node->box );
+  if ( node->num_prim > 0 ){
+    node->cost = area * node->num_prim;
+  } else {
+    node->cost = area * BVH_TRAVERSAL_COST +
+                 node->left->cost + node->right->cost;
+  }
+}
+
+static BVHNode *bvh_treelet_emit( BVHTreelet &t, int set ){
+  if ( !( set & ( set - 1 ) ) ){
+    return t.leaves[ __builtin_ctz( set ) ];
+  }
+  BVHNode *node = t.interior[ t.next_interior++ ];
+  node->left = bvh_treelet_emit( t, t.split[ set ] );
+  node->right = bvh_treelet_emit( t, set ^ t.split[ set ] );
+  node->box = t.box[ set ];
+  node->cost = t.cost[ set ];
+  bvh_order_children( node );
+  return node;
+}
+
+static void bvh_restructure_treelet( BVHNode *root ){
+  BVHTreelet t;
+  t.leaves[0] = root->left;
+  t.leaves[1] = root->right;
+  t.leaf_count = 2;
+  t.interior[0] = root;
+  t.interior_count = 1;
+  while ( t.leaf_count < BVH_TREELET_LEAVES ){
+    int open = -1;
+    float area = -1.0f;
+    for ( int i = 0; i < t.leaf_count; i++ ){
+      const BVHNode *n = t.leaves[i];
+      if ( n->num_prim == 0 && AABB_surface_area( n->box ) > area ){
+        open = i;
+        area = AABB_surface_area( n->box );
+      }
+    }
+    if ( open < 0 ) break;
+    BVHNode *n = t.leaves[ open ];
+    t.interior[ t.interior_count++ ] = n;
+    t.leaves[ open ] = n->left;
+    t.leaves[ t.leaf_count++ ] = n->right;
+  }
+  // Two leaves have only one topology
+  if ( t.leaf_count < 3 ) return;
+
+  // Subsets are processed after all of their proper subsets. Only the
+  // splits giving the first child the lowest leaf of the set are tried,
+  // the others are the same with the children swapped.
+  int full = ( 1 << t.leaf_count ) - 1;
+  for ( int set = 1; set <= full; set++ ){
+    int low = set & -set;
+    if ( set == low ){
+      const BVHNode *leaf = t.leaves[ __builtin_ctz( set ) ];
+      t.box[ set ] = leaf->box;
+      t.cost[ set ] = leaf->cost;
+      continue;
+    }
+    t.box[ set ] = AABB_union( t.box[ set ^ low ], t.box[ low ] );
+    float best = FLT_MAX;
+    int rest = set ^ low;
+    // low plus every proper subset of the other leaves
+    for ( int sub = ( rest - 1 ) & rest; ; sub = ( sub - 1 ) & rest ){
+      int left = sub | low;
+      float c = t.cost[ left ] + t.cost[ set ^ left ];
+      if ( c < best ){
+        best = c;
+        t.split[ set ] = left;
+      }
+      if ( !sub ) break;
+    }
+    t.cost[ set ] = best +
+                    AABB_surface_area( t.box[ set ] ) * BVH_TRAVERSAL_COST;
+  }
+  // Keep the old topology unless the new one is strictly cheaper, the
+  // costs of equal trees differ in the last bits
+  if ( t.cost[ full ] >= root->cost * ( 1.0f - 1e-6f ) ) return;
+  t.next_interior = 0;
+  bvh_treelet_emit( t, full );
+}
+
+// Restructures the treelets of the subtree bottom-up, stopping at
+// stop_depth where the subtrees have been done already
+static void bvh_optimize_node( BVHNode *node, int depth, int stop_depth ){
+  if ( node->num_prim > 0 ){
+    bvh_node_cost( node );
+    return;
+  }
+  if ( depth < stop_depth ){
+    bvh_optimize_node( node->left, depth + 1, stop_depth );
+    bvh_optimize_node( node->right, depth + 1, stop_depth );
+  }
+  bvh_node_cost( node );
+  bvh_restructure_treelet( node );
+}
+
+static void bvh_collect_subtrees(
+    BVHNode *node,
+    int depth,
+    int stop_depth,
+    std::vector<BVHNode *> &out )
+{
+  if ( node->num_prim > 0 ) return;
+  if ( depth == stop_depth ){
+    out.push_back( node );
+    return;
+  }
+  bvh_collect_subtrees( node->left, depth + 1, stop_depth, out );
+  bvh_collect_subtrees( node->right, depth + 1, stop_depth, out );
+}
+
+static void bvh_optimize_task( void *data, int ){
+  bvh_optimize_node( ( BVHNode *)data, 0, INT_MAX );
+}
+
+// Treelets never reach above their root, so the subtrees below a cut
+// are restructured in parallel and the nodes above it afterwards.
+// Leaves and the node count stay the same.
+void bvh_optimize( BVHNode *root, ThreadPool *pool, int passes ){
+  int stop_depth = INT_MAX;
+  if ( pool ){
+    stop_depth = 0;
+    while ( ( 1 << stop_depth ) < 4 * pool->thread_count ) stop_depth++;
+  }
+  for ( int pass = 0; pass < passes; pass++ ){
+    if ( pool ){
+      std::vector<BVHNode *> subtrees;
+      bvh_collect_subtrees( root, 0, stop_depth, subtrees );
+      std::vector<Task> tasks( subtrees.size() );
+      for ( size_t i = 0; i < subtrees.size(); i++ ){
+        tasks[i] = { bvh_optimize_task, subtrees[i], NULL };
+      }
+      if ( !tasks.empty() ) bvh_run_tasks( pool, &tasks[0], tasks.size() );
+    }
+    bvh_optimize_node( root, 0, stop_depth );
+  }
+}
+
+// The arrays live in arena. Their entries are sorted along the Morton
+// curve, so the ranges the deep splits work on only touch a few cache
+// lines of them. The splits only depend on which primitives are in a
+// range, not on their order, so this does not change the tree.
+static BVHBuildPrims bvh_build_prims(
+    Arena *arena,
+    ThreadPool *pool,
+    const std::vector<PrimInfo> &prim )
+{
+  int n = prim.size();
+  MortonPrim *sorted = morton_sort( arena, pool, &prim[0], n );
+  BVHBuildPrims p;
+  for ( int k = 0; k < 3; k++ ){
+    p.centroids[k] = ( float *)arena_alloc( arena, n * sizeof( float ), 64 );
+  }
+  p.boxes = ( AABB *)arena_alloc( arena, n * sizeof( AABB ), 64 );
+  p.prim = ( uint32 *)arena_alloc( arena, n * sizeof( uint32 ), 64 );
+  p.index = ( uint32 *)arena_alloc( arena, n * sizeof( uint32 ), 64 );
+  for ( int i = 0; i < n; i++ ){
+    const PrimInfo &info = prim[ sorted[i].index ];
+    for ( int k = 0; k < 3; k++ ){
+      p.centroids[k][i] = info.centroid[k];
+    }
+    p.boxes[i] = info.box;
+    p.prim[i] = sorted[i].index;
+    p.index[i] = i;
+  }
+  return p;
+}
+
+// A primitive whose box has this many times the area of the box of
+// all the smaller ones is kept out of the tree
+#define BVH_HUGE_AREA_RATIO 4.0f
+// and at most this many, they are tested by every ray
+#define BVH_MAX_UNBOUNDED 16
+
+// Moves the primitives that would only inflate the boxes of the tree
+// from prim to unbounded, such as the ground sphere of radius 1000
+// under a scene of a few units. Going from the largest box down, a
+// primitive is huge while its box is BVH_HUGE_AREA_RATIO times the
+// box of all the ones left. The order of the others is kept.
+static void bvh_split_unbounded(
+    std::vector<PrimInfo> &prim,
+    std::vector<PrimInfo> &unbounded )
+{
+  size_t n = prim.size();
+  std::vector<bool> huge( n, false );
+  int huge_count = 0;
+  while ( huge_count < BVH_MAX_UNBOUNDED &&
+          huge_count + 1 < (int)n )
+  {
+    int largest = -1;
+    float largest_area = -1.0f;
+    for ( size_t i = 0; i < n; i++ ){
+      float area = AABB_surface_area( prim[i].box );
+      if ( !huge[i] && area > largest_area ){
+        largest = i;
+        largest_area = area;
+      }
+    }
+    AABB rest;
+    for ( size_t i = 0; i < n; i++ ){
+      if ( !huge[i] && (int)i != largest ) rest = AABB_union( rest, prim[i].box );
+    }
+    if ( largest_area <= BVH_HUGE_AREA_RATIO * AABB_surface_area( rest ) ){
+      break;
+    }
+    huge[ largest ] = true;
+    huge_count++;
+  }
+  if ( !huge_count ) return;
+  size_t kept = 0;
+  for ( size_t i = 0; i < n; i++ ){
+    if ( huge[i] ) unbounded.push_back( prim[i] );
+    else prim[ kept++ ] = prim[i];
+  }
+  prim.erase( prim.begin() + kept, prim.end() );
+}
+
+// Builds the tree over all the primitives of the world and returns it
+// flattened, allocated from arena. ordered_prims receives the
+// primitives in the order the leaves refer to them, followed by the
+// unbounded ones left out of the tree. With a pool the subtrees are
+// built in parallel, the calling thread must not be one of the pool's
+// workers.
+LinearBVHNode *create_bvh_tree(
+    Arena *arena,
+    const World &w,
+    std::vector<PrimInfo> &ordered_prims,
+    const BVHBuildOptions &opts,
+    ThreadPool *pool,
+    int *node_count,
+    int *unbounded_count )
+{
+  std::vector<PrimInfo> prim;
+  prim.reserve( w.sph_count + w.rect_count + w.instance_count );
+  for ( size_t i = 0; i < w.sph_count; i++ ){
+    prim.push_back(
+        PrimInfo( PrimInfo::SPHERE,
+          (void *)( w.spheres+i ),
+          sphere_aabb( *( w.spheres + i ) )
+        )
+    );
+  }
+
+  for ( size_t i = 0; i < w.rect_count; i++ ){
+    prim.push_back(
+        PrimInfo( PrimInfo::RECTANGLE,
+          (void *)( w.rectangles+ i ),
+          rectangle_AABB( *(w.rectangles+i) ) )
+        );
+  }
+
+  // Instances of empty shapes have an empty box and are left out
+  for ( size_t i = 0; i < w.instance_count; i++ ){
+    const Instance &inst = w.instances[i];
+    if ( inst.box.l.X > inst.box.u.X ) continue;
+    prim.push_back(
+        PrimInfo( PrimInfo::INSTANCE, (void *)( w.instances + i ), inst.box )
+    );
+  }
+  std::vector<PrimInfo> unbounded;
+  for ( size_t i = 0; i < w.plane_count; i++ ){
+    unbounded.push_back(
+        PrimInfo( PrimInfo::PLANE,
+          (void *)( w.planes+i ),
+          (w.planes+i)->box
+          )
+    );
+  }
+  bvh_split_unbounded( prim, unbounded );
+  *unbounded_count = unbounded.size();
+#if 0
+  for ( size_t i = 0; i < w.rect_count; i++ ){
+    prim.push_back(
+        PrimInfo( PrimInfo::RECTANGLE,
+          (void *)( w.rects+i ),
+          (w.rects+i)->bounds
+          )
+    );
+  }
+#endif
+
+  *node_count = 0;
+  ordered_prims.clear();
+  if ( prim.empty() ){
+    ordered_prims.swap( unbounded );
+    return NULL;
+  }
+
+  // The linked tree only lives until it is flattened
+  int arena_count = pool ? pool->thread_count : 1;
+  Arena *arenas = new Arena[ arena_count ];
+  for ( int i = 0; i < arena_count; i++ ){
+    arenas[i] = new_arena();
+  }
+  BVHNode *root = NULL;
+  if ( opts.builder == BVH_BUILD_LBVH ){
+    root = lbvh_build( arenas, pool, prim, opts );
+  } else if ( opts.builder == BVH_BUILD_SBVH ){
+    root = sbvh_build( arenas, prim, opts );
+  } else {
+    BVHBuildPrims prims = bvh_build_prims( arenas, pool, prim );
+    if ( pool && prim.size() >= BVH_PARALLEL_MIN_PRIMS ){
+      BVHBuildContext ctx;
+      ctx.prims = prims;
+      ctx.opts = &opts;
+      ctx.pool = pool;
+      ctx.arenas = arenas;
+      ctx.group.pending = 0;
+      BVHBuildTask root_task = { &ctx, 0, (int)prim.size(), &root };
+      Task task = { bvh_build_task, &root_task, NULL };
+      thread_pool_submit( pool, &task, 1, THREAD_POOL_PRIORITIES - 1,
+                          &ctx.group );
+      thread_pool_wait_group( pool, &ctx.group );
+    } else {
+      root = bvh_recursive_build( arenas, prims, 0, prim.size(), opts );
+    }
+    std::vector<PrimInfo> ordered;
+    ordered.reserve( prim.size() );
+    for ( size_t i = 0; i < prim.size(); i++ ){
+      ordered.push_back( prim[ prims.prim[ prims.index[i] ] ] );
+    }
+    prim.swap( ordered );
+  }
+
+  if ( opts.optimize > 0 ) bvh_optimize( root, pool, opts.optimize );
+  root = bvh_limit_depth( arenas, root, 0 );
+  LinearBVHNode *nodes = bvh_flatten( arena, root, node_count );
+  for ( int i = 0; i < arena_count; i++ ){
+    arena_free( arenas + i );
+  }
+  delete [] arenas;
+  prim.insert( prim.end(), unbounded.begin(), unbounded.end() );
+  ordered_prims.swap( prim );
+  return nodes;
+}
+
+bool instance_hit(
+    const Instance &inst,
+    const Ray &r,
+    float tmin,
+    float tmax,
+    HitRecord &rec );
+
+bool bvh_leaf_hit( 
+    int first,
+    int count,
+    const Ray &r,
+    float tmin,
+    float tmax,
+    HitRecord &rec,
+    std::vector<PrimInfo> &ordered_prims)
+{
+  bool hit_anything = false;
+  HitRecord temp;
+  for ( int i = 0;
+        i < count;
+        i++ )
+  {
+    PrimInfo &p = ordered_prims[ first + i];
+    switch ( p.type ){
+      case PrimInfo::SPHERE:
+        if( hit_sphere( *( (Sphere*)p.data), r, tmin, tmax, temp) ){
+          hit_anything = true;
+          tmax = temp.t;
+          rec = temp;
+        }
+        break;
+      case PrimInfo::PLANE:
+        if( hit_plane( *( (Plane*)p.data), r, tmin, tmax, temp) ){
+          hit_anything = true;
+          tmax = temp.t;
+          rec = temp;
+        }
+        break;
+      case PrimInfo::RECTANGLE:
+#if 0
+        if( hit_AARect( *( (AARect*)p.data), r, tmin, tmax, temp) ){
+          hit_anything = true;
+          tmax = temp.t;
+          rec = temp;
+        }
+#endif
+        if( hit_rect( *( (Rectangle *)p.data),
+              r, tmin, tmax, temp) )
+        {
+          hit_anything = true;
+          tmax = temp.t;
+          rec = temp;
+        }
+        break;
+      case PrimInfo::INSTANCE:
+        if ( instance_hit( *( (Instance *)p.data ), r, tmin, tmax, temp ) ){
+          hit_anything = true;
+          tmax = temp.t;
+          rec = temp;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  return hit_anything;
+}
+
+// Walks the flattened tree with an explicit stack of the children
+// still to visit. The child on the near side of the split plane is
+// visited first, the first child holds the primitives below the plane
+// so the ray's direction along split_axis tells which one that is.
+// Every hit shortens tmax, so once the near child has a hit the far
+// one is mostly culled by its box test.
+bool bvh_traversal_hit( 
+    const LinearBVHNode *nodes,
+    const Ray &r,
+    float tmin,
+    float tmax,
+    HitRecord &rec,
+    std::vector<PrimInfo> &ordered_prims)
+{
+  if ( !nodes ) return false; // empty scene
+  int stack[ BVH_STACK_SIZE ];
+  int top = 0;
+  int current = 0;
+  bool hit_anything = false;
+  for ( ;; ){
+    const LinearBVHNode *node = nodes + current;
+    if ( AABB_hit( node->box, r, tmin, tmax ) ){
+      if ( node->num_prim > 0 ){
+        if ( bvh_leaf_hit( node->first_offset, node->num_prim, r, tmin, tmax,
+                           rec, ordered_prims ) )
+        {
+          hit_anything = true;
+          tmax = rec.t;
+        }
+      } else {
+        if ( r.sign[ node->split_axis ] ){
+          stack[ top++ ] = current + 1;
+          current = node->second_child;
+        } else {
+          stack[ top++ ] = node->second_child;
+          current = current + 1;
+        }
+        continue;
+      }
+    }
+    if ( top == 0 ) break;
+    current = stack[ --top ];
+  }
+  return hit_anything;
+}
+// Wide BVHs, the binary tree collapsed so that every node has up to
+// W children whose boxes are stored as separate arrays per coordinate.
+// One SIMD slab test then checks all the children of a node, with SSE
+// for BVH4 and AVX for BVH8. Children are packed in the first
+// child_count slots. A child with count > 0 is a leaf made of count
+// primitives starting at child, otherwise child is a node index.
+template <int W>
+struct alignas( 4 * W ) BVHWideNode {
+  float lx[W], ly[W], lz[W];
+  float ux[W], uy[W], uz[W];
+  int32 child[W];
+  uint16_t count[W];
+  uint8 child_count;
+};
+typedef BVHWideNode<4> BVH4Node;
+typedef BVHWideNode<8> BVH8Node;
+static_assert( sizeof( BVH4Node ) == 128, "BVH4Node is not 128 bytes" );
+static_assert( sizeof( BVH8Node ) == 256, "BVH8Node is not 256 bytes" );
+
+// Compressed wide nodes. The child boxes are 8 bit steps from origin,
+// the lower corner of the node's box, of 2^exp along every axis. They
+// are rounded outwards, so a decoded box always holds the child.
+template <int W>
+struct alignas( 16 ) BVHQuantNode {
+  float origin[3];
+  int8_t exp[3];
+  uint8 child_count;
+  uint8 lx[W], ly[W], lz[W];
+  uint8 ux[W], uy[W], uz[W];
+  int32 child[W];
+  uint16_t count[W];
+};
+typedef BVHQuantNode<4> BVHQ4Node;
+typedef BVHQuantNode<8> BVHQ8Node;
+static_assert( sizeof( BVHQ4Node ) == 64, "BVHQ4Node is not 64 bytes" );
+static_assert( sizeof( BVHQ8Node ) == 112, "BVHQ8Node is not 112 bytes" );
+static_assert( offsetof( BVHQ4Node, lx ) == 16, "BVHQ4Node boxes unaligned" );
+
+struct BVHStats;
+
+struct BVH {
+  int width;             // 2, 4 or 8, selects the node array used
+  // binary tree, only kept next to quantized nodes for refitting
+  LinearBVHNode *nodes;
+  int node_count;
+  BVH4Node *nodes4;
+  BVH8Node *nodes8;
+  bool quantized;        // the wide nodes are the qnodes instead
+  BVHQ4Node *qnodes4;
+  BVHQ8Node *qnodes8;
+  int wide_count;
+  float build_cost;      // bvh_sah_cost() right after the last full build
+  // ordered_prims[ unbounded_first, + unbounded_count ) are not in the
+  // tree and tested by every ray, see bvh_split_unbounded()
+  int unbounded_first;
+  int unbounded_count;
+  // bvh_compute_stats() of the binary tree when it has been dropped
+  const BVHStats *binary_stats;
+};
+
+static size_t bvh_wide_node_size( int width, bool quantized ){
+  switch ( width ){
+    case 4: return quantized ? sizeof( BVHQ4Node ) : sizeof( BVH4Node );
+    case 8: return quantized ? sizeof( BVHQ8Node ) : sizeof( BVH8Node );
+    default: return 0;
+  }
+}
+
+// The wide node array in use, for code that doesn't look inside
+static const void *bvh_wide_nodes( const BVH &bvh ){
+  if ( bvh.width == 4 ){
+    return bvh.quantized ? (const void *)bvh.qnodes4 :
+                           (const void *)bvh.nodes4;
+  }
+  return bvh.quantized ? (const void *)bvh.qnodes8 :
+                         (const void *)bvh.nodes8;
+}
+
+// False for a scene without bounded primitives
+inline bool bvh_has_tree( const BVH &bvh ){
+  return bvh.nodes || bvh.wide_count > 0;
+}
+
+static int bvh_wide_child_count( const BVH &bvh, int i ){
+  if ( bvh.width == 4 ){
+    return bvh.quantized ? bvh.qnodes4[i].child_count :
+                           bvh.nodes4[i].child_count;
+  }
+  return bvh.quantized ? bvh.qnodes8[i].child_count :
+                         bvh.nodes8[i].child_count;
+}
+
+// Pulls the children of the binary node up into one wide node, always
+// opening the interior child with the largest surface area until there
+// are W children. Nodes are stored depth first from next.
+template <int W>
+static int bvh_collapse_node(
+    const LinearBVHNode *bin,
+    int index,
+    BVHWideNode<W> *nodes,
+    int &next )
+{
+  int children[W] = { index + 1, bin[ index ].second_child };
+  int count = 2;
+  while ( count < W ){
+    int best = -1;
+    float best_area = -1.0f;
+    for ( int i = 0; i < count; i++ ){
+      const LinearBVHNode &c = bin[ children[i] ];
+      float area = AABB_surface_area( c.box );
+      if ( c.num_prim == 0 && area > best_area ){
+        best = i;
+        best_area = area;
+      }
+    }
+    if ( best < 0 ) break;
+    int opened = children[ best ];
+    children[ best ] = opened + 1;
+    children[ count++ ] = bin[ opened ].second_child;
+  }
+
+  int self = next++;
+  BVHWideNode<W> *n = nodes + self;
+  n->child_count = count;
+  for ( int i = 0; i < W; i++ ){
+    if ( i >= count ){
+      // never hit, whatever the ray
+      n->lx[i] = n->ly[i] = n->lz[i] = FLT_MAX;
+      n->ux[i] = n->uy[i] = n->uz[i] = -FLT_MAX;
+      n->child[i] = -1;
+      n->count[i] = 0;
+      continue;
+    }
+    const LinearBVHNode &c = bin[ children[i] ];
+    n->lx[i] = c.box.l.X; n->ly[i] = c.box.l.Y; n->lz[i] = c.box.l.Z;
+    n->ux[i] = c.box.u.X; n->uy[i] = c.box.u.Y; n->uz[i] = c.box.u.Z;
+    if ( c.num_prim > 0 ){
+      n->child[i] = c.first_offset;
+      n->count[i] = c.num_prim;
+    } else {
+      n->count[i] = 0;
+      n->child[i] = bvh_collapse_node( bin, children[i], nodes, next );
+    }
+  }
+  return self;
+}
+
+// The wide nodes are allocated from arena, a tree that is a single leaf
+// gets a root with that leaf as its only child
+template <int W>
+BVHWideNode<W> *bvh_collapse(
+    Arena *arena,
+    const LinearBVHNode *bin,
+    int bin_count,
+    int *count )
+{
+  // every wide node takes the place of at least one binary interior
+  BVHWideNode<W> *nodes = ( BVHWideNode<W> *)arena_alloc(
+      arena, MAX( bin_count, 1 ) * sizeof( BVHWideNode<W> ),
+      alignof( BVHWideNode<W> ) );
+  int next = 0;
+  if ( bin[0].num_prim > 0 ){
+    BVHWideNode<W> *n = nodes + next++;
+    for ( int i = 0; i < W; i++ ){
+      n->lx[i] = n->ly[i] = n->lz[i] = FLT_MAX;
+      n->ux[i] = n->uy[i] = n->uz[i] = -FLT_MAX;
+      n->child[i] = -1;
+      n->count[i] = 0;
+    }
+    const AABB &b = bin[0].box;
+    n->lx[0] = b.l.X; n->ly[0] = b.l.Y; n->lz[0] = b.l.Z;
+    n->ux[0] = b.u.X; n->uy[0] = b.u.Y; n->uz[0] = b.u.Z;
+    n->child[0] = bin[0].first_offset;
+    n->count[0] = bin[0].num_prim;
+    n->child_count = 1;
+  } else {
+    bvh_collapse_node( bin, 0, nodes, next );
+  }
+  *count = next;
+  return nodes;
+}
+
+// 2^e, e is within the exponents of normal floats
+inline float bvh_exp2( int e ){
+  uint32 bits = (uint32)( e + 127 ) << 23;
+  float f;
+  memcpy( &f, &bits, 4 );
+  return f;
+}
+
+// The same float operations as the traversal decodes with
+inline float bvh_dequantize( float origin, float scale, uint8 q ){
+  return origin + (float)q * scale;
+}
+
+// Encodes the boxes of the first count children into n
+template <int W>
+void bvh_quantize_node( BVHQuantNode<W> &n, const AABB *boxes, int count ){
+  AABB box;
+  for ( int c = 0; c < count; c++ ){
+    box = AABB_union( box, boxes[c] );
+  }
+  uint8 *lo[3] = { n.lx, n.ly, n.lz };
+  uint8 *hi[3] = { n.ux, n.uy, n.uz };
+  for ( int k = 0; k < 3; k++ ){
+    float origin = box.l[k];
+    float extent = box.u[k] - origin;
+    int e = extent > 0 ? (int)ceilf( log2f( extent / 255.0f ) ) : -126;
+    e = CLAMP( e, -126, 127 );
+    while ( e < 127 &&
+            bvh_dequantize( origin, bvh_exp2( e ), 255 ) < box.u[k] )
+    {
+      e++;
+    }
+    float scale = bvh_exp2( e );
+    n.origin[k] = origin;
+    n.exp[k] = e;
+    for ( int c = 0; c < W; c++ ){
+      if ( c >= count ){
+        // never hit, whatever the ray
+        lo[k][c] = 255;
+        hi[k][c] = 0;
+        continue;
+      }
+      int ql = (int)floorf( ( boxes[c].l[k] - origin ) / scale );
+      int qh = (int)ceilf( ( boxes[c].u[k] - origin ) / scale );
+      ql = CLAMP( ql, 0, 255 );
+      qh = CLAMP( qh, 0, 255 );
+      while ( ql > 0 &&
+              bvh_dequantize( origin, scale, ql ) > boxes[c].l[k] )
+      {
+        ql--;
+      }
+      while ( qh < 255 &&
+              bvh_dequantize( origin, scale, qh ) < boxes[c].u[k] )
+      {
+        qh++;
+      }
+      lo[k][c] = ql;
+      hi[k][c] = qh;
+    }
+  }
+  n.child_count = count;
+}
+
+template <int W>
+AABB bvh_quant_child_box( const BVHQuantNode<W> &n, int c ){
+  float sx = bvh_exp2( n.exp[0] );
+  float sy = bvh_exp2( n.exp[1] );
+  float sz = bvh_exp2( n.exp[2] );
+  return AABB( v3{ bvh_dequantize( n.origin[0], sx, n.lx[c] ),
+                   bvh_dequantize( n.origin[1], sy, n.ly[c] ),
+                   bvh_dequantize( n.origin[2], sz, n.lz[c] ) },
+               v3{ bvh_dequantize( n.origin[0], sx, n.ux[c] ),
+                   bvh_dequantize( n.origin[1], sy, n.uy[c] ),
+                   bvh_dequantize( n.origin[2], sz, n.uz[c] ) } );
+}
+
+// Compressed copy of the wide nodes, allocated from arena
+template <int W>
+BVHQuantNode<W> *bvh_quantize(
+    Arena *arena,
+    const BVHWideNode<W> *nodes,
+    int count )
+{
+  BVHQuantNode<W> *q = ( BVHQuantNode<W> *)arena_alloc(
+      arena, MAX( count, 1 ) * sizeof( BVHQuantNode<W> ),
+      alignof( BVHQuantNode<W> ) );
+  for ( int i = 0; i < count; i++ ){
+    const BVHWideNode<W> &n = nodes[i];
+    AABB boxes[W];
+    for ( int c = 0; c < n.child_count; c++ ){
+      boxes[c] = AABB( v3{ n.lx[c], n.ly[c], n.lz[c] },
+                       v3{ n.ux[c], n.uy[c], n.uz[c] } );
+      q[i].child[c] = n.child[c];
+      q[i].count[c] = n.count[c];
+    }
+    for ( int c = n.child_count; c < W; c++ ){
+      q[i].child[c] = -1;
+      q[i].count[c] = 0;
+    }
+    bvh_quantize_node( q[i], boxes, n.child_count );
+  }
+  return q;
+}
+
+template <int W>
+AABB bvh_quant_box( const BVHQuantNode<W> &n ){
+  AABB box;
+  for ( int c = 0; c < n.child_count; c++ ){
+    box = AABB_union( box, bvh_quant_child_box( n, c ) );
+  }
+  return box;
+}
+
+// Box of the whole tree, empty without one
+static AABB bvh_root_box( const BVH &bvh ){
+  if ( bvh.nodes ) return bvh.nodes[0].box;
+  if ( !bvh.wide_count ) return AABB();
+  return bvh.width == 4 ? bvh_quant_box( bvh.qnodes4[0] ) :
+                          bvh_quant_box( bvh.qnodes8[0] );
+}
+
+struct BVHStackEntry {
+  int child;
+  int count; // primitives of a leaf, 0 for a node
+  float t;   // where the ray enters the child's box
+};
+
+// Pushes the children that were hit, the nearest one last so that it is
+// popped first
+static inline int bvh_push_sorted(
+    BVHStackEntry *stack,
+    int top,
+    const int32 *child,
+    const uint16_t *count,
+    const float *tnear,
+    int mask )
+{
+  BVHStackEntry hits[8];
+  int n = 0;
+  while ( mask ){
+    int i = __builtin_ctz( mask );
+    mask &= mask - 1;
+    BVHStackEntry e = { child[i], count[i], tnear[i] };
+    int j = n++;
+    // descending order of t
+    while ( j > 0 && hits[ j - 1 ].t < e.t ){
+      hits[j] = hits[ j - 1 ];
+      j--;
+    }
+    hits[j] = e;
+  }
+  for ( int i = 0; i < n; i++ ){
+    stack[ top++ ] = hits[i];
+  }
+  return top;
+}
+
+// Near and far planes of the children, loaded in the order lx, ly,
+// lz, ux, uy, uz
+inline void bvh4_node_bounds( const BVH4Node *n, __m128 b[6] ){
+  b[0] = _mm_load_ps( n->lx );
+  b[1] = _mm_load_ps( n->ly );
+  b[2] = _mm_load_ps( n->lz );
+  b[3] = _mm_load_ps( n->ux );
+  b[4] = _mm_load_ps( n->uy );
+  b[5] = _mm_load_ps( n->uz );
+}
+
+inline __m128 bvh4_dequantize( __m128i q, float origin, int8_t exp ){
+  return _mm_add_ps( _mm_set1_ps( origin ),
+                     _mm_mul_ps( _mm_cvtepi32_ps( q ),
+                                 _mm_set1_ps( bvh_exp2( exp ) ) ) );
+}
+
+// The 24 bytes of the child boxes in two loads, widened with SSE2
+inline void bvh4_node_bounds( const BVHQ4Node *n, __m128 b[6] ){
+  __m128i zero = _mm_setzero_si128();
+  __m128i q = _mm_load_si128( ( const __m128i *)n->lx );
+  __m128i lxly = _mm_unpacklo_epi8( q, zero );
+  __m128i lzux = _mm_unpackhi_epi8( q, zero );
+  __m128i uyuz = _mm_unpacklo_epi8(
+      _mm_loadl_epi64( ( const __m128i *)n->uy ), zero );
+  b[0] = bvh4_dequantize( _mm_unpacklo_epi16( lxly, zero ),
+                          n->origin[0], n->exp[0] );
+  b[1] = bvh4_dequantize( _mm_unpackhi_epi16( lxly, zero ),
+                          n->origin[1], n->exp[1] );
+  b[2] = bvh4_dequantize( _mm_unpacklo_epi16( lzux, zero ),
+                          n->origin[2], n->exp[2] );
+  b[3] = bvh4_dequantize( _mm_unpackhi_epi16( lzux, zero ),
+                          n->origin[0], n->exp[0] );
+  b[4] = bvh4_dequantize( _mm_unpacklo_epi16( uyuz, zero ),
+                          n->origin[1], n->exp[1] );
+  b[5] = bvh4_dequantize( _mm_unpackhi_epi16( uyuz, zero ),
+                          n->origin[2], n->exp[2] );
+}
+
+// Node is BVH4Node or BVHQ4Node
+template <class Node>
+bool bvh4_traversal_hit(
+    const Node *nodes,
+    const Ray &r,
+    float tmin,
+    float tmax,
+    HitRecord &rec,
+    std::vector<PrimInfo> &ordered_prims )
+{
+  __m128 ox = _mm_set1_ps( r.start.X );
+  __m128 oy = _mm_set1_ps( r.start.Y );
+  __m128 oz = _mm_set1_ps( r.start.Z );
+  __m128 ix = _mm_set1_ps( r.inv_dir.X );
+  __m128 iy = _mm_set1_ps( r.inv_dir.Y );
+  __m128 iz = _mm_set1_ps( r.inv_dir.Z );
+  __m128 t0 = _mm_set1_ps( tmin );
+
+  BVHStackEntry stack[ BVH_STACK_SIZE * 4 ];
+  int top = 0;
+  BVHStackEntry e = { 0, 0, tmin };
+  bool hit_anything = false;
+  for ( ;; ){
+    if ( e.count > 0 ){
+      if ( bvh_leaf_hit( e.child, e.count, r, tmin, tmax, rec,
+                         ordered_prims ) )
+      {
+        hit_anything = true;
+        tmax = rec.t;
+      }
+    } else {
+      const Node *n = nodes + e.child;
+      __m128 b[6];
+      bvh4_node_bounds( n, b );
+      // near and far planes picked by the direction, as in AABB_hit
+      __m128 nx = b[ 3 * r.sign[0] ], fx = b[ 3 - 3 * r.sign[0] ];
+      __m128 ny = b[ 1 + 3 * r.sign[1] ], fy = b[ 4 - 3 * r.sign[1] ];
+      __m128 nz = b[ 2 + 3 * r.sign[2] ], fz = b[ 5 - 3 * r.sign[2] ];
+      __m128 tnx = _mm_mul_ps( _mm_sub_ps( nx, ox ), ix );
+      __m128 tny = _mm_mul_ps( _mm_sub_ps( ny, oy ), iy );
+      __m128 tnz = _mm_mul_ps( _mm_sub_ps( nz, oz ), iz );
+      __m128 tfx = _mm_mul_ps( _mm_sub_ps( fx, ox ), ix );
+      __m128 tfy = _mm_mul_ps( _mm_sub_ps( fy, oy ), iy );
+      __m128 tfz = _mm_mul_ps( _mm_sub_ps( fz, oz ), iz );
+      __m128 tn = _mm_max_ps( _mm_max_ps( tnx, tny ), _mm_max_ps( tnz, t0 ) );
+      __m128 tf = _mm_min_ps( _mm_min_ps( tfx, tfy ),
+                              _mm_min_ps( tfz, _mm_set1_ps( tmax ) ) );
+      int mask = _mm_movemask_ps( _mm_cmple_ps( tn, tf ) ) &
+                 ( ( 1 << n->child_count ) - 1 );
+      if ( mask ){
+        alignas( 16 ) float tnear[4];
+        _mm_store_ps( tnear, tn );
+        if ( !( mask & ( mask - 1 ) ) ){
+          // a single child was hit, no need for the stack
+          int i = __builtin_ctz( mask );
+          e = { n->child[i], n->count[i], tnear[i] };
+          continue;
+        }
+        top = bvh_push_sorted( stack, top, n->child, n->count, tnear, mask );
+      }
+    }
+    // children behind the closest hit so far are skipped
+    do {
+      if ( top == 0 ) return hit_anything;
+      e = stack[ --top ];
+    } while ( e.t > tmax );
+  }
+}
+
+__attribute__(( target( "avx2" ) ))
+inline void bvh8_node_bounds( const BVH8Node *n, __m256 b[6] ){
+  b[0] = _mm256_load_ps( n->lx );
+  b[1] = _mm256_load_ps( n->ly );
+  b[2] = _mm256_load_ps( n->lz );
+  b[3] = _mm256_load_ps( n->ux );
+  b[4] = _mm256_load_ps( n->uy );
+  b[5] = _mm256_load_ps( n->uz );
+}
+
+__attribute__(( target( "avx2" ) ))
+inline __m256 bvh8_dequantize( const uint8 *q, float origin, int8_t exp ){
+  __m256i v = _mm256_cvtepu8_epi32( _mm_loadl_epi64( ( const __m128i *)q ) );
+  return _mm256_add_ps( _mm256_set1_ps( origin ),
+                        _mm256_mul_ps( _mm256_cvtepi32_ps( v ),
+                                       _mm256_set1_ps( bvh_exp2( exp ) ) ) );
+}
+
+__attribute__(( target( "avx2" ) ))
+inline void bvh8_node_bounds( const BVHQ8Node *n, __m256 b[6] ){
+  b[0] = bvh8_dequantize( n->lx, n->origin[0], n->exp[0] );
+  b[1] = bvh8_dequantize( n->ly, n->origin[1], n->exp[1] );
+  b[2] = bvh8_dequantize( n->lz, n->origin[2], n->exp[2] );
+  b[3] = bvh8_dequantize( n->ux, n->origin[0], n->exp[0] );
+  b[4] = bvh8_dequantize( n->uy, n->origin[1], n->exp[1] );
+  b[5] = bvh8_dequantize( n->uz, n->origin[2], n->exp[2] );
+}
+
+// Node is BVH8Node or BVHQ8Node
+template <class Node>
+__attribute__(( target( "avx2" ) ))
+bool bvh8_traversal_hit(
+    const Node *nodes,
+    const Ray &r,
+    float tmin,
+    float tmax,
+    HitRecord &rec,
+    std::vector<PrimInfo> &ordered_prims )
+{
+  __m256 ox = _mm256_set1_ps( r.start.X );
+  __m256 oy = _mm256_set1_ps( r.start.Y );
+  __m256 oz = _mm256_set1_ps( r.start.Z );
+  __m256 ix = _mm256_set1_ps( r.inv_dir.X );
+  __m256 iy = _mm256_set1_ps( r.inv_dir.Y );
+  __m256 iz = _mm256_set1_ps( r.inv_dir.Z );
+  __m256 t0 = _mm256_set1_ps( tmin );
+
+  BVHStackEntry stack[ BVH_STACK_SIZE * 8 ];
+  int top = 0;
+  BVHStackEntry e = { 0, 0, tmin };
+  bool hit_anything = false;
+  for ( ;; ){
+    if ( e.count > 0 ){
+      if ( bvh_leaf_hit( e.child, e.count, r, tmin, tmax, rec,
+                         ordered_prims ) )
+      {
+        hit_anything = true;
+        tmax = rec.t;
+      }
+    } else {
+      const Node *n = nodes + e.child;
+      __m256 b[6];
+      bvh8_node_bounds( n, b );
+      __m256 nx = b[ 3 * r.sign[0] ], fx = b[ 3 - 3 * r.sign[0] ];
+      __m256 ny = b[ 1 + 3 * r.sign[1] ], fy = b[ 4 - 3 * r.sign[1] ];
+      __m256 nz = b[ 2 + 3 * r.sign[2] ], fz = b[ 5 - 3 * r.sign[2] ];
+      __m256 tnx = _mm256_mul_ps( _mm256_sub_ps( nx, ox ), ix );
+      __m256 tny = _mm256_mul_ps( _mm256_sub_ps( ny, oy ), iy );
+      __m256 tnz = _mm256_mul_ps( _mm256_sub_ps( nz, oz ), iz );
+      __m256 tfx = _mm256_mul_ps( _mm256_sub_ps( fx, ox ), ix );
+      __m256 tfy = _mm256_mul_ps( _mm256_sub_ps( fy, oy ), iy );
+      __m256 tfz = _mm256_mul_ps( _mm256_sub_ps( fz, oz ), iz );
+      __m256 tn = _mm256_max_ps( _mm256_max_ps( tnx, tny ),
+                                 _mm256_max_ps( tnz, t0 ) );
+      __m256 tf = _mm256_min_ps( _mm256_min_ps( tfx, tfy ),
+                                 _mm256_min_ps( tfz, _mm256_set1_ps( tmax ) ) );
+      int mask = _mm256_movemask_ps( _mm256_cmp_ps( tn, tf, _CMP_LE_OQ ) ) &
+                 ( ( 1 << n->child_count ) - 1 );
+      if ( mask ){
+        alignas( 32 ) float tnear[8];
+        _mm256_store_ps( tnear, tn );
+        if ( !( mask & ( mask - 1 ) ) ){
+          // a single child was hit, no need for the stack
+          int i = __builtin_ctz( mask );
+          e = { n->child[i], n->count[i], tnear[i] };
+          continue;
+        }
+        top = bvh_push_sorted( stack, top, n->child, n->count, tnear, mask );
+      }
+    }
+    // children behind the closest hit so far are skipped
+    do {
+      if ( top == 0 ) return hit_anything;
+      e = stack[ --top ];
+    } while ( e.t > tmax );
+  }
+}
+
+bool bvh_hit(
+    const BVH &bvh,
+    const Ray &r,
+    float tmin,
+    float tmax,
+    HitRecord &rec,
+    std::vector<PrimInfo> &ordered_prims )
+{
+  // The unbounded primitives first, a hit on them limits the traversal
+  bool hit = bvh.unbounded_count > 0 &&
+             bvh_leaf_hit( bvh.unbounded_first, bvh.unbounded_count, r,
+                           tmin, tmax, rec, ordered_prims );
+  if ( hit ) tmax = rec.t;
+  if ( !bvh_has_tree( bvh ) ) return hit; // nothing else in the scene
+  bool found;
+  switch ( bvh.width ){
+    case 4:
+      if ( bvh.quantized ){
+        found = bvh4_traversal_hit( bvh.qnodes4, r, tmin, tmax, rec,
+                                    ordered_prims );
+      } else {
+        found = bvh4_traversal_hit( bvh.nodes4, r, tmin, tmax, rec,
+                                    ordered_prims );
+      }
+      break;
+    case 8:
+      if ( bvh.quantized ){
+        found = bvh8_traversal_hit( bvh.qnodes8, r, tmin, tmax, rec,
+                                    ordered_prims );
+      } else {
+        found = bvh8_traversal_hit( bvh.nodes8, r, tmin, tmax, rec,
+                                    ordered_prims );
+      }
+      break;
+    default:
+      found = bvh_traversal_hit( bvh.nodes, r, tmin, tmax, rec,
+                                 ordered_prims );
+      break;
+  }
+  return found || hit;
+}
+
+// Objects placed by any number of instances. Their tree is built once
+// in the shape's own space, see scene_build_shapes().
+struct Shape {
+  World world;
+  std::vector<PrimInfo> ordered_prims;
+  BVH bvh;
+};
+
+// The ray is moved into the shape's space. Its direction is moved
+// along with its origin, so t is the same in both.
+bool instance_hit(
+    const Instance &inst,
+    const Ray &r,
+    float tmin,
+    float tmax,
+    HitRecord &rec )
+{
+  const v3 *a = inst.axes;
+  float s = 1.0f / inst.scale;
+  v3 o = r.start - inst.position;
+  v3 d = r.direction;
+  Ray local( s * v3{ HMM_DotVec3( a[0], o ), HMM_DotVec3( a[1], o ),
+                     HMM_DotVec3( a[2], o ) },
+             s * v3{ HMM_DotVec3( a[0], d ), HMM_DotVec3( a[1], d ),
+                     HMM_DotVec3( a[2], d ) } );
+  Shape *shape = inst.shape;
+  if ( !bvh_hit( shape->bvh, local, tmin, tmax, rec, shape->ordered_prims ) ){
+    return false;
+  }
+  rec.p = r.point_at( rec.t );
+  rec.n = rec.n.X * a[0] + rec.n.Y * a[1] + rec.n.Z * a[2];
+  return true;
+}
+
+// World space box of the shape's box as the instance places it
+AABB instance_aabb( const Instance &inst, const AABB &shape_box ){
+  AABB box;
+  for ( int c = 0; c < 8; c++ ){
+    v3 p = { shape_box.bounds[ c & 1 ].X,
+             shape_box.bounds[ ( c >> 1 ) & 1 ].Y,
+             shape_box.bounds[ c >> 2 ].Z };
+    box = AABB_union( box, inst.position + inst.scale *
+          ( p.X * inst.axes[0] + p.Y * inst.axes[1] + p.Z * inst.axes[2] ) );
+  }
+  return box;
+}
+
+// Rotation by the quaternion x, y, z, w, which is normalized first
+void instance_set_rotation( Instance &inst, const float q[4] ){
+  v3 u = { q[0], q[1], q[2] };
+  float s = q[3];
+  float len = sqrtf( HMM_DotVec3( u, u ) + s * s );
+  if ( len > 0.0f ){
+    u = u / len;
+    s /= len;
+  } else {
+    s = 1.0f;
+  }
+  for ( int k = 0; k < 3; k++ ){
+    v3 e = { 0.0f, 0.0f, 0.0f };
+    e[k] = 1.0f;
+    inst.axes[k] = 2.0f * HMM_DotVec3( u, e ) * u +
+                   ( s * s - HMM_DotVec3( u, u ) ) * e +
+                   2.0f * s * HMM_Cross( u, e );
+  }
+}
+
+// Widest layout the cpu can traverse
+int bvh_max_width( void ){
+  return __builtin_cpu_supports( "avx2" ) ? 8 : 4;
+}
+
+// Expected cost of a ray through the binary tree relative to one
+// primitive test, the measure the SAH builder minimizes
+float bvh_sah_cost( const LinearBVHNode *nodes, int count ){
+  if ( !count ) return 0.0f;
+  float cost = 0.0f;
+  for ( int i = 0; i < count; i++ ){
+    const LinearBVHNode &n = nodes[i];
+    cost += AABB_surface_area( n.box ) *
+            ( n.num_prim > 0 ? n.num_prim : BVH_TRAVERSAL_COST );
+  }
+  return cost / MAX( AABB_surface_area( nodes[0].box ), 1e-12f );
+}
+
+inline AABB bvh_leaf_bound(
+    const std::vector<PrimInfo> &ordered_prims,
+    int first,
+    int count )
+{
+  AABB box;
+  for ( int i = first; i < first + count; i++ ){
+    box = AABB_union( box, ordered_prims[i].box );
+  }
+  return box;
+}
+
+// Children come after their parent in both layouts, so walking the
+// nodes backwards updates every child before its parent
+template <int W>
+static void bvh_refit_wide(
+    BVHWideNode<W> *nodes,
+    int count,
+    const std::vector<PrimInfo> &ordered_prims )
+{
+  for ( int i = count - 1; i >= 0; i-- ){
+    BVHWideNode<W> *n = nodes + i;
+    for ( int c = 0; c < n->child_count; c++ ){
+      AABB box;
+      if ( n->count[c] > 0 ){
+        box = bvh_leaf_bound( ordered_prims, n->child[c], n->count[c] );
+      } else {
+        const BVHWideNode<W> *child = nodes + n->child[c];
+        for ( int k = 0; k < child->child_count; k++ ){
+          box = AABB_union( box, AABB(
+                v3{ child->lx[k], child->ly[k], child->lz[k] },
+                v3{ child->ux[k], child->uy[k], child->uz[k] } ) );
+        }
+      }
+      n->lx[c] = box.l.X; n->ly[c] = box.l.Y; n->lz[c] = box.l.Z;
+      n->ux[c] = box.u.X; n->uy[c] = box.u.Y; n->uz[c] = box.u.Z;
+    }
+  }
+}
+
+template <int W>
+static void bvh_refit_quant(
+    BVHQuantNode<W> *nodes,
+    int count,
+    const std::vector<PrimInfo> &ordered_prims )
+{
+  for ( int i = count - 1; i >= 0; i-- ){
+    BVHQuantNode<W> *n = nodes + i;
+    AABB boxes[W];
+    for ( int c = 0; c < n->child_count; c++ ){
+      if ( n->count[c] > 0 ){
+        boxes[c] = bvh_leaf_bound( ordered_prims, n->child[c], n->count[c] );
+      } else {
+        boxes[c] = bvh_quant_box( nodes[ n->child[c] ] );
+      }
+    }
+    bvh_quantize_node( *n, boxes, n->child_count );
+  }
+}
+
+// Updates the boxes of the primitives from the spheres, rectangles
+// and instances they point to and those of the nodes bottom up,
+// keeping the topology. Returns the SAH cost of the refitted tree.
+float bvh_refit( BVH &bvh, std::vector<PrimInfo> &ordered_prims ){
+  if ( !bvh.nodes ) return 0.0f;
+  for ( PrimInfo &p : ordered_prims ){
+    switch ( p.type ){
+      case PrimInfo::SPHERE:
+        p.box = sphere_aabb( *( Sphere *)p.data );
+        break;
+      case PrimInfo::RECTANGLE:
+        p.box = rectangle_AABB( *( Rectangle *)p.data );
+        break;
+      case PrimInfo::INSTANCE:
+        p.box = ( ( Instance *)p.data )->box;
+        break;
+      default:
+        break;
+    }
+    p.centroid = 0.5f * ( p.box.l + p.box.u );
+  }
+
+  LinearBVHNode *nodes = bvh.nodes;
+  for ( int i = bvh.node_count - 1; i >= 0; i-- ){
+    LinearBVHNode &n = nodes[i];
+    if ( n.num_prim > 0 ){
+      n.box = bvh_leaf_bound( ordered_prims, n.first_offset, n.num_prim );
+    } else {
+      n.box = AABB_union( nodes[ i + 1 ].box, nodes[ n.second_child ].box );
+    }
+  }
+  if ( bvh.quantized ){
+    if ( bvh.width == 4 ){
+      bvh_refit_quant( bvh.qnodes4, bvh.wide_count, ordered_prims );
+    } else {
+      bvh_refit_quant( bvh.qnodes8, bvh.wide_count, ordered_prims );
+    }
+  } else if ( bvh.width == 4 ){
+    bvh_refit_wide( bvh.nodes4, bvh.wide_count, ordered_prims );
+  } else if ( bvh.width == 8 ){
+    bvh_refit_wide( bvh.nodes8, bvh.wide_count, ordered_prims );
+  }
+  return bvh_sah_cost( nodes, bvh.node_count );
+}
+// Paths shorter than this are never terminated by russian roulette
+#define RR_MIN_DEPTH 3
+
+v3 get_background_color( const Ray &ray ){
+#if 0    
+    v3 direction = HMM_NormalizeVec3( ray.direction );
+    float t = 0.5f * ( direction.Y + 1.0f );
+    
+    v3 start= { 1.0f, 1.0f, 1.0f };
+    v3 end = { 0.5f, 0.7f, 1.0f };
+    return ( 1.0 - t ) * start + t * end;
+#else
+    return v3{0.0f,0.0f,0.0f};
+#endif
+}
+
+// Follows the path bounce by bounce, carrying the product of the
+// attenuations ( the throughput ) instead of recursing. Light only
+// comes from emitters, so the result is the throughput times the
+// emission of the light the path ends on. After RR_MIN_DEPTH bounces
+// a path survives with probability max( throughput ) and is divided
+// by it when it does, which keeps the estimate unbiased while dim
+// paths mostly end early. A path reaching max_depth contributes
+// nothing.
+v3 get_ray_color(
+    const BVH &bvh,
+    const Ray &primary,
+    int max_depth,
+    std::vector<PrimInfo> &ordered_prims,
+    PRNG *rng )
+{
+  v3 throughput = { 1.0f, 1.0f, 1.0f };
+  Ray ray = primary;
+  for ( int depth = 0; depth < max_depth; depth++ ){
+    HitRecord rec;
+    if ( !bvh_hit( bvh, ray, 0.001f, FLT_MAX, rec, ordered_prims ) ){
+      return throughput * get_background_color( ray );
+    }
+    switch ( rec.m->type ){
+      case MATERIAL_DIFFUSE_LIGHT: 
+        return throughput * rec.m->diff_light_color;
+      case MATERIAL_SPOT_LIGHT: {
+        if ( depth == 0 ) return rec.m->spot_light_color; 
+        float x= MAX(-HMM_DotVec3(
+              HMM_NormalizeVec3(ray.direction),
+              rec.n ), 0 );
+        if ( x > rec.m->angle )
+          return throughput * rec.m->spot_light_color;
+        else
+          return HMM_PowerF(x,4) * throughput * rec.m->spot_light_color;
+      }
+      default:
+        break;
+    }
+
+    v3 attn;
+    Ray out;
+    if ( !rec.m->scatter( rec, ray, attn, out, rng ) ){
+      break;
+    }
+    throughput = throughput * attn;
+    ray = out;
+
+    if ( depth + 1 >= RR_MIN_DEPTH ){
+      float survive = MAX( throughput[0], MAX( throughput[1], throughput[2] ) );
+      survive = MIN( survive, 0.95f );
+      if ( prng_float( rng ) >= survive ) break;
+      throughput = throughput / survive;
+    }
+  }
+  return v3{ 0.0f, 0.0f, 0.0f };
+}
+
+
+void print_aabb( const AABB &b ){
+  fprintf( stdout, "Max. bound: " );
+  print_v3( b.u );
+  fprintf( stdout,"\nMin. bound: " );
+  print_v3( b.l );
+}
+
+void print_bvh_info( const LinearBVHNode *node ){
+  fprintf(stdout,"The bounding box is: \n" );
+  print_aabb( node->box );
+  fprintf( stdout, "\n" );
+  if ( node->num_prim > 0 ){
+    fprintf( stdout,"leaf node with %d primitives, starting at %d.\n",
+            node->num_prim, node->first_offset );
+  } else {
+    fprintf( stdout, "Interior node\n" );
+  }
+}
+
+void bvh_tree_print( const LinearBVHNode *nodes, int index ){
+  const LinearBVHNode *node = nodes + index;
+  print_bvh_info( node );
+  fprintf(stdout,"========================================\n");
+  if( node->num_prim == 0 ){
+    fprintf(stdout,"Left Node:\n");
+    bvh_tree_print( nodes, index + 1 ); 
+    fprintf(stdout,"-----------------------------------------\n");
+    fprintf(stdout,"Right Node:\n");
+    bvh_tree_print( nodes, node->second_child );
+    fprintf(stdout,"-----------------------------------------\n");
+  }
+}
+
+const char *bvh_builder_names[] = { "midpoint", "sah", "lbvh", "sbvh" };
+
+enum BVHStatsFormat {
+  BVH_STATS_NONE,
+  BVH_STATS_TEXT,
+  BVH_STATS_JSON
+};
+
+// Leaves with this many primitives or more share the last bucket
+#define BVH_STATS_LEAF_BUCKETS 16
+
+struct BVHStats {
+  int node_count, leaf_count, prim_count;
+  int unbounded_count; // of prim_count, outside of the tree
+  int max_depth;
+  double mean_leaf_depth;
+  int leaf_sizes[ BVH_STATS_LEAF_BUCKETS + 1 ]; // [n] leaves of n prims
+  float sah_cost;
+  // Area of the intersection of the two children's boxes, summed over
+  // the interior nodes relative to the root like the SAH cost, and on
+  // average relative to their parent
+  float overlap;
+  float mean_overlap;
+  int wide_count;
+  float mean_children; // per wide node
+  size_t node_bytes, wide_bytes, prim_bytes;
+  size_t full_node_bytes; // both node arrays, unquantized
+  // The fields above always describe the binary tree, these the
+  // quantized wide nodes rendered from, when there are such
+  bool quantized;
+  int quant_max_depth;
+  double quant_mean_leaf_depth;
+  float quant_sah_cost;
+  float quant_overlap, quant_mean_overlap;
+};
+
+static void bvh_stats_node(
+    const LinearBVHNode *nodes,
+    int index,
+    int depth,
+    BVHStats &stats,
+    double &depth_sum )
+{
+  const LinearBVHNode &n = nodes[ index ];
+  stats.max_depth = MAX( stats.max_depth, depth );
+  if ( n.num_prim > 0 ){
+    stats.leaf_count++;
+    depth_sum += depth;
+    stats.leaf_sizes[ MIN( (int)n.num_prim, BVH_STATS_LEAF_BUCKETS ) ]++;
+    return;
+  }
+  const AABB &l = nodes[ index + 1 ].box;
+  const AABB &r = nodes[ n.second_child ].box;
+  AABB both( v3{ MAX( l.l.X, r.l.X ), MAX( l.l.Y, r.l.Y ),
+                 MAX( l.l.Z, r.l.Z ) },
+             v3{ MIN( l.u.X, r.u.X ), MIN( l.u.Y, r.u.Y ),
+                 MIN( l.u.Z, r.u.Z ) } );
+  float area = AABB_surface_area( both );
+  stats.overlap += area;
+  stats.mean_overlap += area / MAX( AABB_surface_area( n.box ), 1e-12f );
+  bvh_stats_node( nodes, index + 1, depth + 1, stats, depth_sum );
+  bvh_stats_node( nodes, n.second_child, depth + 1, stats, depth_sum );
+}
+
+// The quant_ stats of the wide nodes, into the binary tree's fields of a
+// scratch BVHStats. A wide node counts the overlap of every pair of
+// children and its leaves are one level below.
+template <int W>
+static void bvh_stats_quant(
+    const BVHQuantNode<W> *nodes,
+    int index,
+    int depth,
+    BVHStats &stats,
+    double &depth_sum )
+{
+  const BVHQuantNode<W> &n = nodes[ index ];
+  AABB boxes[W];
+  for ( int c = 0; c < n.child_count; c++ ){
+    boxes[c] = bvh_quant_child_box( n, c );
+  }
+  float area = 0.0f;
+  for ( int c = 0; c < n.child_count; c++ ){
+    for ( int d = c + 1; d < n.child_count; d++ ){
+      const AABB &l = boxes[c];
+      const AABB &r = boxes[d];
+      area += AABB_surface_area(
+          AABB( v3{ MAX( l.l.X, r.l.X ), MAX( l.l.Y, r.l.Y ),
+                    MAX( l.l.Z, r.l.Z ) },
+                v3{ MIN( l.u.X, r.u.X ), MIN( l.u.Y, r.u.Y ),
+                    MIN( l.u.Z, r.u.Z ) } ) );
+    }
+  }
+  stats.overlap += area;
+  stats.mean_overlap += area / MAX( AABB_surface_area( bvh_quant_box( n ) ),
+                                    1e-12f );
+  stats.node_count++;
+  for ( int c = 0; c < n.child_count; c++ ){
+    if ( n.count[c] > 0 ){
+      stats.node_count++;
+      stats.leaf_count++;
+      stats.max_depth = MAX( stats.max_depth, depth + 1 );
+      depth_sum += depth + 1;
+      stats.leaf_sizes[ MIN( (int)n.count[c], BVH_STATS_LEAF_BUCKETS ) ]++;
+      stats.sah_cost += AABB_surface_area( boxes[c] ) * n.count[c];
+    } else {
+      stats.sah_cost += AABB_surface_area( boxes[c] ) * BVH_TRAVERSAL_COST;
+      bvh_stats_quant( nodes, n.child[c], depth + 1, stats, depth_sum );
+    }
+  }
+}
+
+template <int W>
+static void bvh_quant_stats(
+    const BVHQuantNode<W> *nodes,
+    const AABB &root,
+    BVHStats &stats )
+{
+  BVHStats q = {};
+  double depth_sum = 0;
+  bvh_stats_quant( nodes, 0, 0, q, depth_sum );
+  float root_area = MAX( AABB_surface_area( root ), 1e-12f );
+  int interior_count = q.node_count - q.leaf_count;
+  stats.quantized = true;
+  stats.quant_max_depth = q.max_depth;
+  stats.quant_mean_leaf_depth = depth_sum / q.leaf_count;
+  stats.quant_sah_cost = ( q.sah_cost + AABB_surface_area( root ) *
+                                        BVH_TRAVERSAL_COST ) / root_area;
+  stats.quant_overlap = q.overlap / root_area;
+  stats.quant_mean_overlap = interior_count > 0 ?
+                             q.mean_overlap / interior_count : 0.0f;
+}
+
+// Without the binary tree, dropped after quantizing, its stats are the
+// ones bvh_build() took before
+BVHStats bvh_compute_stats( const BVH &bvh, int prim_count ){
+  if ( !bvh.nodes && bvh.binary_stats ){
+    BVHStats stats = *bvh.binary_stats;
+    stats.node_bytes = 0;
+    return stats;
+  }
+  BVHStats stats = {};
+  stats.prim_count = prim_count;
+  stats.prim_bytes = prim_count * sizeof( PrimInfo );
+  stats.unbounded_count = bvh.unbounded_count;
+  if ( !bvh.nodes ) return stats;
+  double depth_sum = 0;
+  AABB root = bvh.nodes[0].box;
+  stats.node_bytes = bvh.node_count * sizeof( LinearBVHNode );
+  bvh_stats_node( bvh.nodes, 0, 0, stats, depth_sum );
+  stats.node_count = bvh.node_count;
+  stats.sah_cost = bvh_sah_cost( bvh.nodes, bvh.node_count );
+  stats.mean_leaf_depth = depth_sum / stats.leaf_count;
+  int interior_count = stats.node_count - stats.leaf_count;
+  stats.overlap /= MAX( AABB_surface_area( root ), 1e-12f );
+  if ( interior_count > 0 ) stats.mean_overlap /= interior_count;
+
+  stats.wide_count = bvh.wide_count;
+  int children = 0;
+  for ( int i = 0; i < bvh.wide_count; i++ ){
+    children += bvh_wide_child_count( bvh, i );
+  }
+  if ( bvh.wide_count ){
+    stats.mean_children = children / (float)bvh.wide_count;
+    stats.wide_bytes = bvh.wide_count *
+                       bvh_wide_node_size( bvh.width, bvh.quantized );
+  }
+  stats.full_node_bytes =
+      stats.node_bytes +
+      bvh.wide_count * bvh_wide_node_size( bvh.width, false );
+  if ( bvh.quantized && bvh.width == 4 ){
+    bvh_quant_stats( bvh.qnodes4, root, stats );
+  } else if ( bvh.quantized ){
+    bvh_quant_stats( bvh.qnodes8, root, stats );
+  }
+  return stats;
+}
+
+static void print_json_string( FILE *fp, const char *s ){
+  fputc( '"', fp );
+  for ( ; *s; s++ ){
+    if ( *s == '"' || *s == '\\' ) fputc( '\\', fp );
+    fputc( *s, fp );
+  }
+  fputc( '"', fp );
+}
+
+// One line of JSON per scene, or a few lines of text
+void bvh_stats_print(
+    FILE *fp,
+    BVHStatsFormat format,
+    const char *scene,
+    const BVHStats &stats,
+    const BVHBuildOptions &opts,
+    int width )
+{
+  const double mb = 1024.0 * 1024.0;
+  size_t total = stats.node_bytes + stats.wide_bytes + stats.prim_bytes;
+  if ( format == BVH_STATS_JSON ){
+    fprintf( fp, "{\"scene\": " );
+    print_json_string( fp, scene );
+    fprintf( fp, ", \"builder\": \"%s\", \"leaf_size\": %d, "
+                 "\"width\": %d, \"nodes\": %d, \"leaves\": %d, "
+                 "\"primitives\": %d, \"unbounded\": %d, "
+                 "\"max_depth\": %d, "
+                 "\"mean_leaf_depth\": %.3f, \"sah_cost\": %.4f, "
+                 "\"overlap\": %.4f, \"mean_overlap\": %.4f, "
+                 "\"wide_nodes\": %d, \"mean_children\": %.3f, "
+                 "\"leaf_sizes\": [",
+             bvh_builder_names[ opts.builder ], opts.max_leaf_size, width,
+             stats.node_count, stats.leaf_count, stats.prim_count,
+             stats.unbounded_count,
+             stats.max_depth, stats.mean_leaf_depth, stats.sah_cost,
+             stats.overlap, stats.mean_overlap, stats.wide_count,
+             stats.mean_children );
+    for ( int i = 1; i <= BVH_STATS_LEAF_BUCKETS; i++ ){
+      fprintf( fp, "%s%d", i > 1 ? ", " : "", stats.leaf_sizes[i] );
+    }
+    fprintf( fp, "], \"quantized\": " );
+    if ( stats.quantized ){
+      fprintf( fp, "{ \"max_depth\": %d, \"mean_leaf_depth\": %.3f, "
+                   "\"sah_cost\": %.4f, \"overlap\": %.4f, "
+                   "\"mean_overlap\": %.4f }",
+               stats.quant_max_depth, stats.quant_mean_leaf_depth,
+               stats.quant_sah_cost, stats.quant_overlap,
+               stats.quant_mean_overlap );
+    } else {
+      fprintf( fp, "null" );
+    }
+    fprintf( fp, ", \"bytes\": { \"nodes\": %zu, \"wide_nodes\": %zu, "
+                 "\"primitives\": %zu, \"total\": %zu, "
+                 "\"unquantized_nodes\": %zu } }\n",
+             stats.node_bytes, stats.wide_bytes, stats.prim_bytes, total,
+             stats.full_node_bytes );
+    return;
+  }
+  fprintf( fp, "BVH of %s, %s, leaf size %d, width %d\n", scene,
+           bvh_builder_names[ opts.builder ], opts.max_leaf_size, width );
+  fprintf( fp, "  %d nodes, %d leaves, %d primitives\n",
+           stats.node_count, stats.leaf_count, stats.prim_count );
+  if ( stats.unbounded_count ){
+    fprintf( fp, "  %d of them unbounded, outside of the tree\n",
+             stats.unbounded_count );
+  }
+  fprintf( fp, "  depth max. %d, mean of the leaves %.2f\n",
+           stats.max_depth, stats.mean_leaf_depth );
+  fprintf( fp, "  SAH cost %.3f, sibling overlap %.3f ( mean %.1f %% of"
+               " the parent )\n",
+           stats.sah_cost, stats.overlap, 100.0f * stats.mean_overlap );
+  if ( stats.wide_count ){
+    fprintf( fp, "  %d wide nodes, %.2f children on average\n",
+             stats.wide_count, stats.mean_children );
+  }
+  if ( stats.quantized ){
+    fprintf( fp, "  quantized wide nodes: depth max. %d, mean of the leaves"
+                 " %.2f,\n    SAH cost %.3f, sibling overlap %.3f ( mean"
+                 " %.1f %% of the parent )\n",
+             stats.quant_max_depth, stats.quant_mean_leaf_depth,
+             stats.quant_sah_cost, stats.quant_overlap,
+             100.0f * stats.quant_mean_overlap );
+  }
+  fprintf( fp, "  leaf sizes" );
+  for ( int i = 1; i <= BVH_STATS_LEAF_BUCKETS; i++ ){
+    if ( !stats.leaf_sizes[i] ) continue;
+    fprintf( fp, " %d%s: %d", i, i == BVH_STATS_LEAF_BUCKETS ? "+" : "",
+             stats.leaf_sizes[i] );
+  }
+  fprintf( fp, "\n  memory %.2f MB nodes, %.2f MB wide nodes, %.2f MB"
+               " primitives, %.2f MB total\n",
+           stats.node_bytes / mb, stats.wide_bytes / mb,
+           stats.prim_bytes / mb, total / mb );
+  size_t node_bytes = stats.node_bytes + stats.wide_bytes;
+  if ( stats.full_node_bytes != node_bytes ){
+    fprintf( fp, "  nodes quantized from %.2f MB to %.2f MB, %.2fx smaller\n",
+             stats.full_node_bytes / mb, node_bytes / mb,
+             stats.full_node_bytes / (double)node_bytes );
+  }
+}
+
+void print_sphere_info( Sphere *sph ){
+  fprintf(stdout,"Center: ");
   print_v3( sph->c );
   fprintf(stdout,"\nRadius: %f", sph->r );
 }
-void print_plane_info( Plane *p){
-  fprintf(stdout,"Normal: ");
-  print_v3( p->n );
-  fprintf(stdout,"\nPoint: ");
-  print_v3( p->p );
+void print_plane_info( Plane *p){
+  fprintf(stdout,"Normal: ");
+  print_v3( p->n );
+  fprintf(stdout,"\nPoint: ");
+  print_v3( p->p );
+}
+void print_rect_info( Rectangle *r ){
+  fprintf(stdout,"Normal: " );
+  print_v3( r->n );
+  fprintf( stdout, "\ncorner point: " );
+  print_v3( r->p0 );
+
+  fprintf( stdout, "\nVector s1: " );
+  print_v3( r->s1 );
+  fprintf( stdout, "\nVector s2: " );
+  print_v3( r->s2 );
+
+  fprintf( stdout, "\nl1 = %f, l2 = %f\n", r->l1, r->l2 );
+
+}
+
+void print_priminfo( PrimInfo *p ){
+  switch ( p->type ){
+    case PrimInfo::SPHERE:
+      fprintf(stdout,"Sphere\n");
+      print_sphere_info( (Sphere *)p->data );
+      break;
+    case PrimInfo::PLANE:
+      fprintf(stdout,"Plane\n" );
+      print_plane_info( (Plane *)p->data );
+      break;
+    case PrimInfo::RECTANGLE:
+      fprintf(stdout,"Rectangle\n" );
+      print_rect_info( (Rectangle *)p->data );
+      break;
+    case PrimInfo::INSTANCE:
+      fprintf(stdout,"Instance\nposition: " );
+      print_v3( ( (Instance *)p->data )->position );
+      fprintf(stdout,"\nscale = %f\n", ( (Instance *)p->data )->scale );
+      break;
+  }
+}
+
+void world_decode_sphere_data( 
+    World &w,
+    const DumpObjectData &data,
+    Texture *textures,
+    Material *materials)
+{
+  
+}
+
+
+Texture dump_get_texture( const DumpObjectData &d, Perlin *perlin){
+  Texture t;
+  switch( d.texture_type ){
+    case DumpObjectData::TEXTURE_PLAIN_COLOR:
+      t = create_texture_plain( d.texture_data.color );
+      break;
+    case DumpObjectData::TEXTURE_CHECKER:
+      t = create_texture_checker( d.texture_data.checker_color[0],
+                                  d.texture_data.checker_color[1],
+                                  d.texture_data.freq );
+      break;
+    case DumpObjectData::TEXTURE_MARBLE:
+      t = create_texture_marble( perlin,
+                                 d.texture_data.marble_color);
+      break;
+    default:
+      fprintf( stderr, "Unknown Texture detected!\n" );
+      break;
+  }
+  return t;
+}
+Material dump_get_material(
+    const DumpObjectData &d,
+    Texture &tex )
+{
+  Material m;
+  switch( d.material_type ){
+    case DumpObjectData::MATERIAL_DIFFUSE_LIGHT:
+      m = create_diffuse_light( d.material_data.diff_light_color );
+      break;
+    case DumpObjectData::MATERIAL_PURE_DIFFUSE:
+      m = create_material_pure_diffuse( tex );
+      break;
+    case DumpObjectData::MATERIAL_METALLIC:
+      m = create_material_metallic( tex, d.material_data.fuzz );
+      break;
+    case DumpObjectData::MATERIAL_GLASS:
+      printf("Creating glass material!\n");
+      m = create_material_glass( tex, d.material_data.ri);
+      break;
+    case DumpObjectData::MATERIAL_SPOT_LIGHT:
+      m = create_spot_light( d.material_data.spot_light_color, 
+                             d.material_data.angle );
+      break;
+  }
+  return m;
+}
+
+enum BVHSource {
+  BVH_BUILT,
+  BVH_REFITTED, // the previous scene's tree
+  BVH_CACHED    // mapped from the scene's cache file
+};
+
+const char *bvh_source_names[] = { "build", "refit", "cache" };
+
+// Everything loaded from a dump file. All the storage comes from
+// the two arenas, which are reset and not freed between scenes so a
+// batch of renders keeps reusing the same memory.
+struct Scene {
+  Arena arena;     // world, textures, materials
+  Arena bvh_arena;
+  World world;
+  Texture *textures;
+  Material *materials;
+  std::vector<Shape> shapes; // their trees live in arena too
+  Camera camera;
+  float aspect_ratio;
+  std::vector<PrimInfo> ordered_prims;
+  BVH bvh;
+  BVHBuildOptions bvh_options;
+  double bvh_build_time; // seconds
+  BVHSource bvh_source;
+  void *bvh_map;         // cache file the tree lives in, see bvh_cache_load()
+  size_t bvh_map_size;
+};
+
+Scene *scene_create( const BVHBuildOptions &bvh_options ){
+  Scene *scene = new Scene;
+  scene->bvh_options = bvh_options;
+  scene->bvh_build_time = 0;
+  scene->bvh_source = BVH_BUILT;
+  scene->bvh_map = NULL;
+  scene->bvh_map_size = 0;
+  scene->arena = new_arena();
+  scene->bvh_arena = new_arena();
+  scene->world = {};
+  scene->textures = NULL;
+  scene->materials = NULL;
+  scene->aspect_ratio = 0;
+  scene->bvh = {};
+  return scene;
+}
+
+void scene_reset_world( Scene &scene ){
+  arena_reset( &scene.arena );
+  scene.shapes.clear();
+  scene.world = {};
+  scene.textures = NULL;
+  scene.materials = NULL;
+}
+
+void scene_reset_bvh( Scene &scene ){
+  arena_reset( &scene.bvh_arena );
+  if ( scene.bvh_map ){
+    munmap( scene.bvh_map, scene.bvh_map_size );
+    scene.bvh_map = NULL;
+    scene.bvh_map_size = 0;
+  }
+  scene.ordered_prims.clear();
+  scene.bvh = {};
+  scene.bvh_build_time = 0;
+  scene.bvh_source = BVH_BUILT;
+}
+
+void scene_reset( Scene &scene ){
+  scene_reset_world( scene );
+  scene_reset_bvh( scene );
+}
+
+void scene_destroy( Scene *scene ){
+  scene_reset_bvh( *scene );
+  arena_free( &scene->arena );
+  arena_free( &scene->bvh_arena );
+  delete scene;
+}
+
+uint8 *read_binary_file( const char *path, size_t &size ){
+  FILE *fp = fopen( path, "rb" );
+  if ( !fp ){
+    fprintf( stderr, "%s, ", path );
+    perror( "Unable to open scene file! " );
+    return NULL;
+  }
+  fseek( fp, 0, SEEK_END );
+  long len = ftell( fp );
+  fseek( fp, 0, SEEK_SET );
+  uint8 *data = ( uint8 *)malloc( MAX( len, 1L ) );
+  if ( len < 0 || fread( data, 1, len, fp ) != (size_t)len ){
+    fprintf( stderr, "Unable to read %s\n", path );
+    free( data );
+    fclose( fp );
+    return NULL;
+  }
+  fclose( fp );
+  size = len;
+  return data;
+}
+
+// Storage for as many objects as the caps allow
+static void world_alloc( World &w, Arena *arena ){
+  w.spheres = ( Sphere *)arena_alloc( arena,
+                  MAX( w.sph_cap, 1 ) * sizeof( Sphere ), 16 );
+  w.rectangles = ( Rectangle *)arena_alloc( arena,
+                  MAX( w.rect_cap, 1 ) * sizeof( Rectangle ), 16 );
+  w.instances = ( Instance *)arena_alloc( arena,
+                  MAX( w.instance_cap, 1 ) * sizeof( Instance ), 16 );
+}
+
+// Reads a dump from fp, path is only used in the error messages
+bool world_read(
+    FILE *fp,
+    const char *path,
+    Scene &scene,
+    Perlin *perlin )
+{
+  DumpCameraData camera_data;
+  uint32 data_count;
+  if ( fread( &camera_data, sizeof(camera_data),1, fp ) != 1 ||
+       fread( &data_count, sizeof(data_count), 1, fp ) != 1 )
+  {
+    fprintf( stderr, "%s: truncated scene file\n", path );
+    return false;
+  }
+
+  Camera c(
+      camera_data.look_from,
+      camera_data.look_at,
+      camera_data.z,
+      camera_data.vfov,
+      camera_data.aspect_ratio,
+      camera_data.aperture,
+      camera_data.focal_dist
+  );
+  scene.camera = c;
+  scene.aspect_ratio = camera_data.aspect_ratio;
+
+  Arena *arena = &scene.arena;
+  DumpObjectData *object_data = ( DumpObjectData *)arena_alloc( arena,
+                            MAX( data_count, 1 ) * sizeof( DumpObjectData ),
+                            16 );
+  if ( fread( object_data, sizeof(*object_data), data_count, fp ) !=
+       data_count )
+  {
+    fprintf( stderr, "%s: truncated scene file\n", path );
+    return false;
+  }
+
+  // Size the storage from the file, materials keep pointers into the
+  // texture array so neither of them may move once filled. The parts
+  // of a shape go to the shape's own world.
+  World &w = scene.world;
+  uint shape_count = 0;
+  for ( uint i = 0; i < data_count; i++ ){
+    if ( object_data[i].type == DumpObjectData::SHAPE ) shape_count++;
+  }
+  scene.shapes.resize( shape_count );
+  World *target = &w;
+  uint shape_end = 0;
+  for ( uint i = 0, shape = 0; i < data_count; i++ ){
+    if ( i == shape_end ) target = &w;
+    const DumpObjectData &data = object_data[i];
+    switch ( data.type ){
+      case DumpObjectData::RECTANGLE: target->rect_cap++; break;
+      case DumpObjectData::SPHERE: target->sph_cap++; break;
+      case DumpObjectData::SHAPE:
+        if ( target != &w ||
+             data.object_data.shape_objects > data_count - i - 1 )
+        {
+          fprintf( stderr, "%s: invalid shape at object %u\n", path, i );
+          return false;
+        }
+        target = &scene.shapes[ shape++ ].world;
+        shape_end = i + 1 + data.object_data.shape_objects;
+        break;
+      case DumpObjectData::INSTANCE:
+        if ( target != &w ){
+          fprintf( stderr, "%s: instance inside a shape at object %u\n",
+                   path, i );
+          return false;
+        }
+        w.instance_cap++;
+        break;
+      default: break;
+    }
+  }
+  world_alloc( w, arena );
+  for ( Shape &shape : scene.shapes ){
+    world_alloc( shape.world, arena );
+  }
+  scene.textures = ( Texture *)arena_alloc( arena,
+                  MAX( data_count, 1 ) * sizeof( Texture ), 16 );
+  scene.materials = ( Material *)arena_alloc( arena,
+                  MAX( data_count, 1 ) * sizeof( Material ), 16 );
+  
+  target = &w;
+  shape_end = 0;
+  for ( uint i = 0, shape = 0; i < data_count; i++ ){
+    if ( i == shape_end ) target = &w;
+    const DumpObjectData &data = object_data[i];
+    Material *m = &scene.materials[i];
+    switch ( data.type ){
+      case DumpObjectData::RECTANGLE:
+        {
+          scene.textures[i] = dump_get_texture( data, perlin );
+          *m = dump_get_material( data, scene.textures[i] );
+          Rectangle rect;
+          rect.p0 = data.object_data.p0;
+          rect.s1 = data.object_data.s1;
+          rect.s2 = data.object_data.s2;
+          rect.n = data.object_data.n;
+          rect.l1 = data.object_data.l1;
+          rect.l2 = data.object_data.l2;
+          rect.p1 = rect.p0 + rect.l1 * rect.s1;
+          rect.p2 = rect.p0 + rect.l1 * rect.s1 + rect.l2 * rect.s2;
+          rect.p3 = rect.p0 + rect.l2 * rect.s2;
+          rect.box = rectangle_AABB( rect ) ;
+          rect.m = m;
+          world_add_rectangle( *target, rect );
+        }
+        break;
+
+      case DumpObjectData::SPHERE:
+        {
+          scene.textures[i] = dump_get_texture( data, perlin );
+          *m = dump_get_material( data, scene.textures[i] );
+          Sphere sphere( data.object_data.center, 
+              data.object_data.radius, m );
+          world_add_sphere( *target, sphere );
+        }
+        break;
+
+      case DumpObjectData::SHAPE:
+        target = &scene.shapes[ shape++ ].world;
+        shape_end = i + 1 + data.object_data.shape_objects;
+        break;
+
+      case DumpObjectData::INSTANCE:
+        {
+          if ( data.object_data.shape_index >= shape_count ||
+               !( data.object_data.scale > 0.0f ) )
+          {
+            fprintf( stderr, "%s: invalid instance at object %u\n",
+                     path, i );
+            return false;
+          }
+          Instance inst;
+          inst.shape = &scene.shapes[ data.object_data.shape_index ];
+          inst.position = data.object_data.position;
+          inst.scale = data.object_data.scale;
+          instance_set_rotation( inst, data.object_data.orientation );
+          inst.box = AABB();
+          w.instances[ w.instance_count++ ] = inst;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  return true;
+}
+
+bool world_get_from_file(
+    const char *path,
+    Scene &scene,
+    Perlin *perlin )
+{
+  FILE *fp = fopen( path, "rb" );
+  if ( !fp ){
+    fprintf( stderr, "%s, ", path );
+    perror( "Unable to open scene file! " );
+    return false;
+  }
+  bool ok = world_read( fp, path, scene, perlin );
+  fclose( fp );
+  return ok;
+}
+
+// Builds the tree over w with the nodes used for rendering allocated
+// from arena
+static void bvh_build(
+    BVH &bvh,
+    Arena *arena,
+    const World &w,
+    std::vector<PrimInfo> &ordered_prims,
+    const BVHBuildOptions &opts,
+    ThreadPool *pool )
+{
+  bvh = {};
+  // Compressed nodes are made from the full ones, which are dropped.
+  // So is the binary tree unless it is refitted.
+  bool quantize = opts.width > 2 && opts.quantize;
+  Arena temp = new_arena();
+  Arena *wide_arena = quantize ? &temp : arena;
+  Arena *binary_arena = quantize && !opts.refit ? &temp : arena;
+  bvh.nodes = create_bvh_tree( binary_arena, w, ordered_prims, opts, pool,
+                               &bvh.node_count, &bvh.unbounded_count );
+  bvh.unbounded_first = ordered_prims.size() - bvh.unbounded_count;
+  bvh.width = bvh.nodes ? opts.width : 2;
+  bvh.quantized = bvh.width > 2 && quantize;
+  if ( bvh.width == 4 ){
+    bvh.nodes4 = bvh_collapse<4>( wide_arena, bvh.nodes,
+                                  bvh.node_count, &bvh.wide_count );
+    if ( bvh.quantized ){
+      bvh.qnodes4 = bvh_quantize( arena, bvh.nodes4, bvh.wide_count );
+      bvh.nodes4 = NULL;
+    }
+  } else if ( bvh.width == 8 ){
+    bvh.nodes8 = bvh_collapse<8>( wide_arena, bvh.nodes,
+                                  bvh.node_count, &bvh.wide_count );
+    if ( bvh.quantized ){
+      bvh.qnodes8 = bvh_quantize( arena, bvh.nodes8, bvh.wide_count );
+      bvh.nodes8 = NULL;
+    }
+  }
+  bvh.build_cost = bvh_sah_cost( bvh.nodes, bvh.node_count );
+  if ( binary_arena == &temp ){
+    BVHStats *stats = ( BVHStats *)arena_alloc( arena, sizeof( BVHStats ),
+                                                alignof( BVHStats ) );
+    *stats = bvh_compute_stats( bvh, ordered_prims.size() );
+    bvh.binary_stats = stats;
+    bvh.nodes = NULL;
+    bvh.node_count = 0;
+  }
+  arena_free( &temp );
+}
+
+void scene_build_bvh( Scene &scene, ThreadPool *pool ){
+  bvh_build( scene.bvh, &scene.bvh_arena, scene.world, scene.ordered_prims,
+             scene.bvh_options, pool );
+}
+
+// Every shape gets its tree once, whatever the number of its
+// instances, then the instances their world space boxes. They go
+// with the world, the cache only holds the scene's tree.
+void scene_build_shapes( Scene &scene, ThreadPool *pool ){
+  for ( Shape &shape : scene.shapes ){
+    bvh_build( shape.bvh, &scene.arena, shape.world, shape.ordered_prims,
+               scene.bvh_options, pool );
+  }
+  World &w = scene.world;
+  for ( uint i = 0; i < w.instance_count; i++ ){
+    Instance &inst = w.instances[i];
+    const Shape &shape = *inst.shape;
+    // The unbounded parts of the shape are outside of its tree
+    AABB box = bvh_root_box( shape.bvh );
+    for ( int j = 0; j < shape.bvh.unbounded_count; j++ ){
+      box = AABB_union(
+          box, shape.ordered_prims[ shape.bvh.unbounded_first + j ].box );
+    }
+    inst.box = box.l.X > box.u.X ? AABB() : instance_aabb( inst, box );
+  }
+}
+
+// The tree of a scene file is cached in <scene>.bvh, the node arrays
+// as they are used for rendering and the order of the primitives as
+// indices into the world, spheres, rectangles, instances then planes,
+// with repeats after spatial splits. The arrays start at
+// BVH_CACHE_ALIGN aligned offsets, so a mapped file is used in place.
+#define BVH_CACHE_MAGIC 0x48564252 // "RBVH"
+#define BVH_CACHE_VERSION 8
+#define BVH_CACHE_ALIGN 64
+
+struct BVHCacheHeader {
+  uint32 magic;
+  uint32 version;
+  uint64 scene_hash;
+  int32 builder;
+  int32 max_leaf_size;
+  int32 width;
+  int32 quantized;
+  int32 optimize;
+  float split_budget;
+  uint32 sph_count;
+  uint32 rect_count;
+  uint32 instance_count;
+  uint32 plane_count;
+  uint32 ref_count; // entries of ordered_prims
+  uint32 unbounded_count; // the last ones, not in the tree
+  int32 node_count;
+  int32 wide_count;
+  float build_cost;
+  uint64 nodes_offset;
+  uint64 wide_offset;
+  uint64 prims_offset;
+  uint64 file_size;
+  BVHStats binary_stats; // of the dropped binary tree, node_count is 0
+};
+
+// FNV-1a over 64 bit words, the tail byte by byte
+uint64 hash_bytes( const void *data, size_t size ){
+  const uint8 *p = ( const uint8 *)data;
+  uint64 h = 0xcbf29ce484222325ull ^ size;
+  size_t words = size / 8;
+  for ( size_t i = 0; i < words; i++ ){
+    uint64 w;
+    memcpy( &w, p + 8 * i, 8 );
+    h = ( h ^ w ) * 0x100000001b3ull;
+  }
+  for ( size_t i = 8 * words; i < size; i++ ){
+    h = ( h ^ p[i] ) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+static BVHCacheHeader bvh_cache_header(
+    const Scene &scene,
+    uint64 hash,
+    uint32 ref_count )
+{
+  const BVH &bvh = scene.bvh;
+  BVHCacheHeader h = {};
+  h.magic = BVH_CACHE_MAGIC;
+  h.version = BVH_CACHE_VERSION;
+  h.scene_hash = hash;
+  h.builder = scene.bvh_options.builder;
+  h.max_leaf_size = scene.bvh_options.max_leaf_size;
+  h.width = bvh.width;
+  h.quantized = bvh.quantized;
+  h.optimize = scene.bvh_options.optimize;
+  h.split_budget = scene.bvh_options.builder == BVH_BUILD_SBVH ?
+                   scene.bvh_options.split_budget : 0.0f;
+  h.sph_count = scene.world.sph_count;
+  h.rect_count = scene.world.rect_count;
+  h.instance_count = scene.world.instance_count;
+  h.plane_count = scene.world.plane_count;
+  h.ref_count = ref_count;
+  h.unbounded_count = bvh.unbounded_count;
+  h.node_count = bvh.node_count;
+  h.wide_count = bvh.wide_count;
+  h.build_cost = bvh.build_cost;
+  if ( !bvh.nodes && bvh.binary_stats ) h.binary_stats = *bvh.binary_stats;
+  h.nodes_offset = ALIGN_UP( sizeof( h ), BVH_CACHE_ALIGN );
+  h.wide_offset = ALIGN_UP( h.nodes_offset +
+                            h.node_count * sizeof( LinearBVHNode ),
+                            BVH_CACHE_ALIGN );
+  h.prims_offset = ALIGN_UP( h.wide_offset +
+                             h.wide_count *
+                             bvh_wide_node_size( h.width, h.quantized ),
+                             BVH_CACHE_ALIGN );
+  h.file_size = h.prims_offset + h.ref_count * sizeof( uint32 );
+  return h;
+}
+
+static bool write_padding( FILE *fp, uint64 offset ){
+  static const uint8 zeros[ BVH_CACHE_ALIGN ] = {};
+  long pos = ftell( fp );
+  return pos >= 0 && (uint64)pos <= offset &&
+         fwrite( zeros, 1, offset - pos, fp ) == offset - pos;
+}
+
+// Written to a temporary file and renamed, like the checkpoints, so
+// a run never maps a half written cache
+bool bvh_cache_write( const Scene &scene, const char *path, uint64 hash ){
+  const BVH &bvh = scene.bvh;
+  if ( !bvh_has_tree( bvh ) ) return false;
+  char tmp[1040];
+  snprintf( tmp, sizeof( tmp ), "%s.tmp", path );
+  FILE *fp = fopen( tmp, "wb" );
+  if ( !fp ){
+    fprintf( stderr, "%s, ", tmp );
+    perror( "Unable to write BVH cache! " );
+    return false;
+  }
+  BVHCacheHeader h = bvh_cache_header( scene, hash,
+                                       scene.ordered_prims.size() );
+  const World &w = scene.world;
+  std::vector<uint32> prims;
+  prims.reserve( scene.ordered_prims.size() );
+  for ( const PrimInfo &p : scene.ordered_prims ){
+    if ( p.type == PrimInfo::SPHERE ){
+      prims.push_back( ( Sphere *)p.data - w.spheres );
+    } else if ( p.type == PrimInfo::RECTANGLE ){
+      prims.push_back( w.sph_count + ( ( Rectangle *)p.data - w.rectangles ) );
+    } else if ( p.type == PrimInfo::INSTANCE ){
+      prims.push_back( w.sph_count + w.rect_count +
+                       ( ( Instance *)p.data - w.instances ) );
+    } else if ( p.type == PrimInfo::PLANE ){
+      prims.push_back( w.sph_count + w.rect_count + w.instance_count +
+                       ( ( Plane *)p.data - w.planes ) );
+    } else {
+      fprintf( stderr, "Unable to write BVH cache %s, unknown primitive"
+                       " type %d\n", path, (int)p.type );
+      fclose( fp );
+      remove( tmp );
+      return false;
+    }
+  }
+  const void *wide = bvh_wide_nodes( bvh );
+  bool ok = fwrite( &h, sizeof( h ), 1, fp ) == 1 &&
+            write_padding( fp, h.nodes_offset ) &&
+            fwrite( bvh.nodes, sizeof( LinearBVHNode ), h.node_count, fp ) ==
+              (size_t)h.node_count &&
+            write_padding( fp, h.wide_offset ) &&
+            ( !h.wide_count ||
+              fwrite( wide, bvh_wide_node_size( h.width, h.quantized ),
+                      h.wide_count,
+                      fp ) == (size_t)h.wide_count ) &&
+            write_padding( fp, h.prims_offset ) &&
+            fwrite( &prims[0], sizeof( uint32 ), prims.size(), fp ) ==
+              prims.size();
+  ok = ( fclose( fp ) == 0 ) && ok;
+  if ( !ok || rename( tmp, path ) != 0 ){
+    fprintf( stderr, "Unable to write BVH cache %s\n", path );
+    remove( tmp );
+    return false;
+  }
+  return true;
+}
+
+// Maps the cache when it was written for the same dump and build
+// options. The pages are private, so a refit only changes this run's
+// copy. The primitives are rebuilt from the index array, the nodes are
+// used without a copy.
+bool bvh_cache_load( Scene &scene, const char *path, uint64 hash ){
+  int fd = open( path, O_RDONLY );
+  if ( fd < 0 ) return false;
+  struct stat st;
+  if ( fstat( fd, &st ) != 0 || st.st_size < (off_t)sizeof( BVHCacheHeader ) ){
+    close( fd );
+    return false;
+  }
+  size_t size = st.st_size;
+  void *map = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED ) return false;
+
+  const BVHCacheHeader *h = ( const BVHCacheHeader *)map;
+  const World &w = scene.world;
+  BVH &bvh = scene.bvh;
+  // The layout expected for the counts in the file
+  bvh = {};
+  bvh.width = scene.bvh_options.width;
+  bvh.quantized = bvh.width > 2 && scene.bvh_options.quantize;
+  bvh.node_count = h->node_count;
+  bvh.wide_count = h->wide_count;
+  BVHCacheHeader expect = bvh_cache_header( scene, hash, h->ref_count );
+  if ( h->magic != expect.magic || h->version != expect.version ||
+       h->scene_hash != expect.scene_hash ||
+       h->builder != expect.builder ||
+       h->max_leaf_size != expect.max_leaf_size ||
+       h->width != expect.width ||
+       h->quantized != expect.quantized ||
+       h->optimize != expect.optimize ||
+       h->split_budget != expect.split_budget ||
+       h->sph_count != expect.sph_count ||
+       h->rect_count != expect.rect_count ||
+       h->instance_count != expect.instance_count ||
+       h->plane_count != expect.plane_count ||
+       h->node_count < 0 || h->wide_count < 0 ||
+       // without the binary tree, which refitting needs
+       ( !h->node_count && ( !h->wide_count || scene.bvh_options.refit ) ) ||
+       h->unbounded_count > h->ref_count ||
+       h->prims_offset != expect.prims_offset ||
+       h->file_size != expect.file_size || size != expect.file_size )
+  {
+    bvh = {};
+    munmap( map, size );
+    return false;
+  }
+
+  uint8 *base = ( uint8 *)map;
+  const uint32 *prims = ( const uint32 *)( base + h->prims_offset );
+  uint32 prim_count = w.sph_count + w.rect_count;
+  uint32 instance_end = prim_count + w.instance_count;
+  uint32 plane_end = instance_end + w.plane_count;
+  std::vector<PrimInfo> &ordered_prims = scene.ordered_prims;
+  ordered_prims.clear();
+  ordered_prims.reserve( h->ref_count );
+  for ( uint32 i = 0; i < h->ref_count; i++ ){
+    uint32 index = prims[i];
+    if ( index < w.sph_count ){
+      Sphere *sph = w.spheres + index;
+      ordered_prims.push_back(
+          PrimInfo( PrimInfo::SPHERE, sph, sphere_aabb( *sph ) ) );
+    } else if ( index < prim_count ){
+      Rectangle *rect = w.rectangles + ( index - w.sph_count );
+      ordered_prims.push_back(
+          PrimInfo( PrimInfo::RECTANGLE, rect, rect->box ) );
+    } else if ( index < instance_end ){
+      Instance *inst = w.instances + ( index - prim_count );
+      ordered_prims.push_back(
+          PrimInfo( PrimInfo::INSTANCE, inst, inst->box ) );
+    } else if ( index < plane_end ){
+      Plane *plane = w.planes + ( index - instance_end );
+      ordered_prims.push_back(
+          PrimInfo( PrimInfo::PLANE, plane, plane->box ) );
+    } else {
+      ordered_prims.clear();
+      bvh = {};
+      munmap( map, size );
+      return false;
+    }
+  }
+  if ( h->node_count ){
+    bvh.nodes = ( LinearBVHNode *)( base + h->nodes_offset );
+  } else {
+    bvh.binary_stats = &h->binary_stats;
+  }
+  void *wide = base + h->wide_offset;
+  if ( bvh.width == 4 ){
+    if ( bvh.quantized ) bvh.qnodes4 = ( BVHQ4Node *)wide;
+    else bvh.nodes4 = ( BVH4Node *)wide;
+  } else if ( bvh.width == 8 ){
+    if ( bvh.quantized ) bvh.qnodes8 = ( BVHQ8Node *)wide;
+    else bvh.nodes8 = ( BVH8Node *)wide;
+  }
+  bvh.build_cost = h->build_cost;
+  bvh.unbounded_count = h->unbounded_count;
+  bvh.unbounded_first = h->ref_count - h->unbounded_count;
+  scene.bvh_map = map;
+  scene.bvh_map_size = size;
+  return true;
+}
+
+// Refitting stops once the SAH cost has grown by this factor since
+// the last full build
+#define BVH_REFIT_MAX_COST_GROWTH 1.5f
+
+// Clears the scene for the next world. With refitting on the tree is
+// kept for scene_update_bvh(), which gets the previous world.
+static void scene_begin_load( Scene &scene, World &prev ){
+  prev = scene.world;
+  if ( scene.bvh_options.refit && scene.bvh.nodes ){
+    scene_reset_world( scene );
+  } else {
+    scene_reset( scene );
+  }
+}
+
+// Frames of an animation have the same spheres, rectangles and
+// instances in the same order, only moved. When the new world has as
+// many of each as the previous one its primitives are swapped into the
+// kept tree, which is refitted, and rebuilt only once it has degraded
+// too much.
+// Otherwise the tree is mapped from cache_path when that holds the
+// tree of the dump with this hash, or built from scratch and cached.
+static void scene_update_bvh(
+    Scene &scene,
+    const World &prev,
+    ThreadPool *pool,
+    const char *cache_path,
+    uint64 hash )
+{
+  auto start = std::chrono::steady_clock::now();
+  scene_build_shapes( scene, pool );
+  const World &w = scene.world;
+  bool refitted = false;
+  if ( scene.bvh.nodes && w.sph_count == prev.sph_count &&
+       w.rect_count == prev.rect_count &&
+       w.instance_count == prev.instance_count )
+  {
+    for ( PrimInfo &p : scene.ordered_prims ){
+      if ( p.type == PrimInfo::SPHERE ){
+        p.data = w.spheres + ( ( Sphere *)p.data - prev.spheres );
+      } else if ( p.type == PrimInfo::RECTANGLE ){
+        p.data = w.rectangles + ( ( Rectangle *)p.data - prev.rectangles );
+      } else if ( p.type == PrimInfo::INSTANCE ){
+        p.data = w.instances + ( ( Instance *)p.data - prev.instances );
+      }
+    }
+    float cost = bvh_refit( scene.bvh, scene.ordered_prims );
+    refitted = cost <= scene.bvh.build_cost * BVH_REFIT_MAX_COST_GROWTH;
+  }
+  BVHSource source = BVH_REFITTED;
+  if ( !refitted ){
+    scene_reset_bvh( scene );
+    if ( cache_path && bvh_cache_load( scene, cache_path, hash ) ){
+      source = BVH_CACHED;
+    } else {
+      scene_build_bvh( scene, pool );
+      if ( cache_path ) bvh_cache_write( scene, cache_path, hash );
+      source = BVH_BUILT;
+    }
+  }
+  scene.bvh_source = source;
+  scene.bvh_build_time = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start ).count();
+}
+
+// Reads the dump held in memory and sets up its BVH. cache_path is
+// the BVH cache file or NULL.
+static bool scene_load_dump( Scene &scene, const void *data, size_t size,
+                             const char *name, Perlin *perlin,
+                             ThreadPool *pool, const char *cache_path )
+{
+  World prev;
+  scene_begin_load( scene, prev );
+  FILE *fp = fmemopen( ( void *)data, size, "rb" );
+  if ( !fp ){
+    perror( "fmemopen failed! " );
+    scene_reset( scene );
+    return false;
+  }
+  bool ok = world_read( fp, name, scene, perlin );
+  fclose( fp );
+  if ( !ok ){
+    scene_reset( scene );
+    return false;
+  }
+  uint64 hash = cache_path ? hash_bytes( data, size ) : 0;
+  scene_update_bvh( scene, prev, pool, cache_path, hash );
+  return true;
+}
+
+// Loads the scene and builds its BVH, on the pool's workers if there
+// is a pool. With caching on the whole file is read first, it is
+// hashed to find out whether <path>.bvh is still valid.
+bool scene_load( Scene &scene, const char *path, Perlin *perlin,
+                 ThreadPool *pool )
+{
+  if ( scene.bvh_options.cache ){
+    size_t size;
+    uint8 *data = read_binary_file( path, size );
+    if ( !data ){
+      scene_reset( scene );
+      return false;
+    }
+    char cache_path[1040];
+    snprintf( cache_path, sizeof( cache_path ), "%s.bvh", path );
+    bool ok = scene_load_dump( scene, data, size, path, perlin, pool,
+                               cache_path );
+    free( data );
+    return ok;
+  }
+  World prev;
+  scene_begin_load( scene, prev );
+  if ( !world_get_from_file( path, scene, perlin ) ){
+    scene_reset( scene );
+    return false;
+  }
+  scene_update_bvh( scene, prev, pool, NULL, 0 );
+  return true;
+}
+
+// Same from a dump held in memory, e.g. one received from the
+// coordinator
+bool scene_load_memory( Scene &scene, const void *data, size_t size,
+                        const char *name, Perlin *perlin,
+                        ThreadPool *pool )
+{
+  return scene_load_dump( scene, data, size, name, perlin, pool, NULL );
+}
+
+
+
+#define TILE_SIZE 16
+
+enum ClientRequest {
+  CLIENT_NONE,
+  CLIENT_SUBMIT,
+  CLIENT_STATUS,
+  CLIENT_CANCEL
+};
+
+struct RenderOptions {
+  int thread_count;
+  bool use_seed;
+  uint64 seed;
+  uint64 samples;        // samples per pixel cap
+  uint32 pass_samples;   // samples per pixel added by every pass
+  int max_depth;         // max. bounces of a path
+  int height;            // of the image, the width follows the camera
+  bool quiet;            // no progress output
+  double time_budget;    // seconds, 0 for no limit
+  double write_interval; // seconds between intermediate images, 0 for none
+  const char *output;
+
+  // Adaptive sampling, a pixel stops receiving samples once it has
+  // min_samples and the relative error of its mean is below threshold
+  bool adaptive;
+  uint32 min_samples;
+  float threshold;
+
+  // Scene files to render, more than one renders them as a batch
+  // and names the images after the scene files
+  char **scenes;
+  const char *output_dir;
+  bool print_bvh;
+  BVHStatsFormat bvh_stats;
+  BVHBuildOptions bvh;
+
+  // Seconds between checkpoints, 0 disables them. The checkpoint of
+  // an image is written next to it as <image>.ckpt
+  double checkpoint_interval;
+  bool resume;
+
+  // Writes the linear sums next to the image as <image>.acc, see the
+  // merge tool
+  bool write_accum;
+  uint64 stream;
+
+  // Distributed rendering, see coordinator_main()
+  const char *coordinator; // address to listen on
+  const char *worker;      // address of the coordinator
+  int spawn;               // local workers started by the coordinator
+  double worker_timeout;   // seconds without a message before a worker
+                           // is dropped, or without any worker before
+                           // the coordinator gives up
+
+  // Render daemon, see daemon_main(), and the requests sent to it
+  const char *daemon;      // address to listen on
+  int max_jobs;            // jobs rendering at the same time
+  int scene_cache;         // loaded scenes kept around
+  ClientRequest client_request;
+  const char *client_addr;
+  const char *cancel_id;
+  int priority;
+};
+
+struct RenderJob;
+
+struct RenderTile {
+  // Pixel range [x0,x1) x [y0,y1) in image space, y = 0 is the top row
+  int x0, y0, x1, y1;
+  RenderJob *job;
+  PRNG rng; // stream owned by the tile, whichever thread renders it
+  uint32 passes_done;
+};
+
+struct RenderJob {
+  const BVH *bvh;
+  std::vector<PrimInfo> *ordered_prims;
+  Camera *camera;
+  int nx, ny;
+  Framebuffer *fb;
+  uint32 pass_samples;
+  int max_depth;
+  double deadline; // tiles are skipped once this has passed, 0 for none
+  bool report_progress;
+  bool adaptive; // only pixels marked active in the framebuffer are sampled
+  uint64 scene_hash; // hash_bytes() of the scene file, for checkpoints
+
+  // Progress of the render, saved in checkpoints along with the tiles.
+  // A stopped pass leaves some tiles with passes_done == pass + 1.
+  uint32 pass;
+  std::atomic<uint64> samples_done;
+
+  int priority;                // of the tiles in the thread pool
+  std::atomic<bool> cancelled; // tiles are skipped and the render stops
+
+  RenderTile *tiles;
+  std::atomic<int> tiles_completed;
+  std::atomic<int> tiles_skipped;
+  std::atomic<int> percent_reported;
+};
+
+// Set by SIGTERM/SIGINT when checkpoints are enabled, tiles that have
+// not started yet are skipped and the render stops after the pass
+static volatile sig_atomic_t render_stop_requested = 0;
+
+static void render_stop_handler( int sig ){
+  render_stop_requested = 1;
+}
+
+double get_time( void ){
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// Adds pass_samples samples to every pixel of the tile
+void render_tile( void *data, int worker ){
+  RenderTile *tile = ( RenderTile *)data;
+  RenderJob *job = tile->job;
+  if ( tile->passes_done > job->pass ){
+    // rendered before the checkpoint this job was resumed from
+    return;
+  }
+  if ( render_stop_requested || job->cancelled ||
+       ( job->deadline > 0 && get_time() >= job->deadline ) )
+  {
+    job->tiles_skipped++;
+    return;
+  }
+  PRNG *rng = &tile->rng;
+  Framebuffer *fb = job->fb;
+  int nx = job->nx, ny = job->ny;
+  for ( int y = tile->y0; y < tile->y1; y++ ){
+    int j = ny - 1 - y;
+    for ( int i = tile->x0; i < tile->x1; i++ ){
+      int p = y * nx + i;
+      if ( job->adaptive && !fb->active[p] ) continue;
+      v3 color = { 0.0f, 0.0f, 0.0f };
+      float lum_sq = 0.0f;
+      for ( uint32 k = 0; k < job->pass_samples ; k++ ){
+        float s1 = ( i + prng_float( rng ) )/(float)nx;
+        float s2 = ( j + prng_float( rng ) )/(float)ny;
+        Ray r = job->camera->get_ray( s1, s2, rng );
+        v3 c = get_ray_color( *job->bvh, r, job->max_depth,
+                              *job->ordered_prims, rng );
+        float l = luminance( c );
+        color = color + c;
+        lum_sq += l * l;
+      }
+      fb->accum[p] += color;
+      fb->samples[p] += job->pass_samples;
+      fb->lum_sq[p] += lum_sq;
+    }
+  }
+  tile->passes_done++;
+
+  if ( !job->report_progress ) return;
+  // Report progress in steps of five percent
+  int done = ++job->tiles_completed;
+  int percent = ( done * 20 / array_length( job->tiles ) ) * 5;
+  int last = job->percent_reported;
+  while ( percent > last ){
+    if ( job->percent_reported.compare_exchange_weak( last, percent ) ){
+      printf("Ray tracing %d percent completed\n", percent );
+      break;
+    }
+  }
+}
+
+// Every tile gets its own generator, one jump() ( 2^128 numbers )
+// apart from the previous tile's one
+void render_create_tiles( RenderJob &job, PRNG base ){
+  int tiles_x = ( job.nx + TILE_SIZE - 1 )/TILE_SIZE;
+  int tiles_y = ( job.ny + TILE_SIZE - 1 )/TILE_SIZE;
+  if ( job.tiles ){
+    array_clear( job.tiles );
+  } else {
+    job.tiles = array_allocate( RenderTile, tiles_x * tiles_y );
+  }
+  for ( int ty = 0; ty < tiles_y; ty++ ){
+    for ( int tx = 0; tx < tiles_x; tx++ ){
+      RenderTile tile;
+      tile.x0 = tx * TILE_SIZE;
+      tile.y0 = ty * TILE_SIZE;
+      tile.x1 = MIN( tile.x0 + TILE_SIZE, job.nx );
+      tile.y1 = MIN( tile.y0 + TILE_SIZE, job.ny );
+      tile.job = &job;
+      tile.rng = base;
+      tile.passes_done = 0;
+      prng_jump( &base );
+      array_push( job.tiles, tile );
+    }
+  }
+}
+
+// Points the job at the scene and sizes the framebuffer and the tiles
+// for its image, the framebuffer is cleared
+void render_job_setup( RenderJob &job, Scene *scene, int ny, PRNG base ){
+  Framebuffer &fb = *job.fb;
+  int nx = (int)( ny * scene->aspect_ratio );
+  if ( fb.nx != nx || fb.ny != ny ){
+    framebuffer_free( fb );
+    fb = framebuffer_create( nx, ny );
+  } else {
+    framebuffer_clear( fb );
+  }
+  job.bvh = &scene->bvh;
+  job.ordered_prims = &scene->ordered_prims;
+  job.camera = &scene->camera;
+  job.nx = nx;
+  job.ny = ny;
+  render_create_tiles( job, base );
+  job.pass = 0;
+  job.samples_done = 0;
+  job.priority = 0;
+  job.cancelled = false;
+  job.scene_hash = 0;
+}
+
+// Seeds the main generator and builds the perlin tables from it.
+// Returns the base of the render streams, which start 2^192 numbers
+// after the main thread's one. Every stream is another 2^192 numbers
+// further, so runs with the same seed and different streams sample
+// the same scene independently.
+PRNG render_init_random(
+    uint64 seed,
+    uint64 stream,
+    Arena *perlin_arena,
+    Perlin &perlin )
+{
+  prng_seed( seed );
+  arena_reset( perlin_arena );
+  perlin = create_perlin( perlin_arena, 4.0f,256 );
+  PRNG render_rng = PRNG_Global;
+  for ( uint64 i = 0; i <= stream; i++ ){
+    prng_long_jump( &render_rng );
+  }
+  return render_rng;
+}
+
+// Renders the listed tiles, the first count tiles if indices is NULL
+void render_tiles(
+    ThreadPool *pool,
+    RenderJob &job,
+    const uint32 *indices,
+    uint count )
+{
+  if ( count == 0 ) return;
+  job.tiles_completed = 0;
+  job.tiles_skipped = 0;
+  job.percent_reported = 0;
+  Task *tasks = array_allocate( Task, count );
+  for ( uint i = 0; i < count; i++ ){
+    uint32 t = indices ? indices[i] : i;
+    array_push( tasks, Task{ render_tile, (void *)( job.tiles + t ), NULL } );
+  }
+  // Other jobs may share the pool, wait for this job's tiles only
+  TaskGroup group;
+  group.pending = 0;
+  thread_pool_submit( pool, tasks, count, job.priority, &group );
+  thread_pool_wait_group( pool, &group );
+  array_free( tasks );
+}
+
+// Renders one pass over all the tiles
+void render_pass( ThreadPool *pool, RenderJob &job ){
+  render_tiles( pool, job, NULL, array_length( job.tiles ) );
+}
+
+// Checkpoint file: header, then the rng state and passes_done of every
+// tile, then the framebuffer. A resumed render continues with the same
+// tile streams, so it ends with the same image as an uninterrupted one.
+// The checkpoint is removed once the image is complete.
+#define CHECKPOINT_MAGIC 0x504b4352 // "RCKP"
+#define CHECKPOINT_VERSION 3
+
+struct CheckpointHeader {
+  uint32 magic;
+  uint32 version;
+  uint64 seed;
+  uint64 scene_hash;
+  int32 nx, ny;
+  uint32 tile_count;
+  uint32 pass_samples;
+  uint64 samples;
+  uint32 adaptive;
+  int32 max_depth;
+  uint32 pass;
+  uint64 samples_done;
+};
+
+struct CheckpointTile {
+  PRNG rng;
+  uint32 passes_done;
+  uint32 pad;
+};
+
+// Written to a temporary file first and renamed over the old one, so a
+// kill during the write never leaves a broken checkpoint behind
+bool checkpoint_write(
+    const char *path,
+    const RenderJob &job,
+    const RenderOptions &opts,
+    uint64 seed )
+{
+  char tmp[1024];
+  snprintf( tmp, sizeof( tmp ), "%s.tmp", path );
+  FILE *fp = fopen( tmp, "wb" );
+  if ( !fp ){
+    fprintf( stderr, "%s, ", tmp );
+    perror( "Unable to write checkpoint! " );
+    return false;
+  }
+  CheckpointHeader header = {};
+  header.magic = CHECKPOINT_MAGIC;
+  header.version = CHECKPOINT_VERSION;
+  header.seed = seed;
+  header.scene_hash = job.scene_hash;
+  header.nx = job.nx;
+  header.ny = job.ny;
+  header.tile_count = array_length( job.tiles );
+  header.pass_samples = opts.pass_samples;
+  header.samples = opts.samples;
+  header.adaptive = opts.adaptive;
+  header.max_depth = opts.max_depth;
+  header.pass = job.pass;
+  header.samples_done = job.samples_done;
+  bool ok = fwrite( &header, sizeof( header ), 1, fp ) == 1;
+  for ( uint i = 0; ok && i < header.tile_count; i++ ){
+    CheckpointTile tile = { job.tiles[i].rng, job.tiles[i].passes_done, 0 };
+    ok = fwrite( &tile, sizeof( tile ), 1, fp ) == 1;
+  }
+  ok = ok && framebuffer_save( *job.fb, fp );
+  ok = ( fclose( fp ) == 0 ) && ok;
+  if ( !ok || rename( tmp, path ) != 0 ){
+    fprintf( stderr, "Unable to write checkpoint %s\n", path );
+    remove( tmp );
+    return false;
+  }
+  return true;
+}
+
+static bool checkpoint_read_header( FILE *fp, CheckpointHeader &header ){
+  return fread( &header, sizeof( header ), 1, fp ) == 1 &&
+         header.magic == CHECKPOINT_MAGIC &&
+         header.version == CHECKPOINT_VERSION;
+}
+
+// Only the seed, it is needed for the perlin tables before any scene
+// is loaded
+bool checkpoint_read_seed( const char *path, uint64 &seed ){
+  FILE *fp = fopen( path, "rb" );
+  if ( !fp ) return false;
+  CheckpointHeader header;
+  bool ok = checkpoint_read_header( fp, header );
+  fclose( fp );
+  if ( ok ) seed = header.seed;
+  return ok;
+}
+
+// Hash of the scene file the checkpoints of its image are written for
+bool checkpoint_scene_hash( const char *path, uint64 &hash ){
+  size_t size;
+  uint8 *data = read_binary_file( path, size );
+  if ( !data ) return false;
+  hash = hash_bytes( data, size );
+  free( data );
+  return true;
+}
+
+// Restores the job's tiles and framebuffer, which must already be set
+// up for the same image size. Fails if the checkpoint was written with
+// different settings or for a changed scene file, those would not give
+// the same image.
+bool checkpoint_read(
+    const char *path,
+    RenderJob &job,
+    const RenderOptions &opts )
+{
+  FILE *fp = fopen( path, "rb" );
+  if ( !fp ){
+    fprintf( stderr, "%s, ", path );
+    perror( "Unable to open checkpoint! " );
+    return false;
+  }
+  CheckpointHeader header;
+  if ( !checkpoint_read_header( fp, header ) ){
+    fprintf( stderr, "%s is not a checkpoint\n", path );
+    fclose( fp );
+    return false;
+  }
+  if ( header.nx != job.nx || header.ny != job.ny ||
+       header.tile_count != array_length( job.tiles ) ||
+       header.pass_samples != opts.pass_samples ||
+       header.samples != opts.samples ||
+       header.adaptive != (uint32)opts.adaptive ||
+       header.max_depth != opts.max_depth )
+  {
+    fprintf( stderr, "Checkpoint %s was written with different render"
+                     " options ( %dx%d, %" PRIu64 " spp, %u per pass,"
+                     " max. depth %d%s )\n",
+             path, header.nx, header.ny, header.samples,
+             header.pass_samples, header.max_depth,
+             header.adaptive ? ", adaptive" : "" );
+    fclose( fp );
+    return false;
+  }
+  if ( header.scene_hash != job.scene_hash ){
+    fprintf( stderr, "Checkpoint %s was written for a different version"
+                     " of the scene file\n", path );
+    fclose( fp );
+    return false;
+  }
+  bool ok = true;
+  for ( uint i = 0; ok && i < header.tile_count; i++ ){
+    CheckpointTile tile;
+    ok = fread( &tile, sizeof( tile ), 1, fp ) == 1;
+    job.tiles[i].rng = tile.rng;
+    job.tiles[i].passes_done = tile.passes_done;
+  }
+  ok = ok && framebuffer_load( *job.fb, fp );
+  fclose( fp );
+  if ( !ok ){
+    fprintf( stderr, "Checkpoint %s is truncated\n", path );
+    return false;
+  }
+  job.pass = header.pass;
+  job.samples_done = header.samples_done;
+  return true;
+}
+
+// fprintf() to the progress log, which is NULL when --quiet
+static void render_log( FILE *log_file, const char *format, ... ){
+  if ( !log_file ) return;
+  va_list args;
+  va_start( args, format );
+  vfprintf( log_file, format, args );
+  va_end( args );
+}
+
+// Adds passes until the sample cap or the time budget is reached.
+// In progressive mode the current image is written out every
+// write_interval seconds, so there is always a usable image. With
+// checkpoints enabled the state is saved every checkpoint_interval
+// seconds and whenever the render stops early. Returns false when it
+// stopped before the image was complete.
+bool render_progressive(
+    ThreadPool *pool,
+    RenderJob &job,
+    const RenderOptions &opts,
+    const char *output,
+    const char *checkpoint,
+    uint64 seed )
+{
+  bool progressive = opts.pass_samples < opts.samples ||
+                     opts.time_budget > 0;
+  job.report_progress = !progressive && !opts.quiet;
+  FILE *log_file = opts.quiet ? NULL : stdout;
+  job.adaptive = opts.adaptive;
+  job.max_depth = opts.max_depth;
+
+  double start = get_time();
+  double last_write = start;
+  double last_checkpoint = start;
+  job.deadline = ( opts.time_budget > 0 ) ? start + opts.time_budget : 0;
+
+  bool stopped = false;
+  while ( job.samples_done < opts.samples ){
+    // A pass cut short by a stop keeps the active pixels it started with
+    bool resumed_pass = false;
+    for ( uint i = 0; i < array_length( job.tiles ); i++ ){
+      resumed_pass |= job.tiles[i].passes_done > job.pass;
+    }
+    int active = job.nx * job.ny;
+    if ( job.adaptive ){
+      if ( resumed_pass ){
+        active = 0;
+        for ( int p = 0; p < job.nx * job.ny; p++ ){
+          active += job.fb->active[p];
+        }
+      } else {
+        active = framebuffer_update_active( *job.fb, opts.min_samples,
+                                            opts.threshold );
+      }
+      if ( active == 0 ){
+        render_log( log_file, "All pixels converged\n" );
+        break;
+      }
+    }
+    job.pass_samples = (uint32)MIN( (uint64)opts.pass_samples,
+                                    opts.samples - job.samples_done );
+    render_pass( pool, job );
+    double now = get_time();
+    if ( job.tiles_skipped > 0 ){
+      if ( render_stop_requested ){
+        render_log( log_file, "Stopped during pass %d, %d tiles skipped\n",
+                    job.pass + 1, (int)job.tiles_skipped );
+      } else if ( !job.cancelled ){
+        render_log( log_file, "Time budget reached during pass %d, %d tiles"
+                              " skipped\n",
+                    job.pass + 1, (int)job.tiles_skipped );
+      }
+      stopped = true;
+      break;
+    }
+    job.samples_done += job.pass_samples;
+    job.pass++;
+    if ( progressive ){
+      render_log( log_file, "Pass %d: %" PRIu64 " max. spp, %d pixels"
+                            " sampled, %.2f s\n",
+                  job.pass, (uint64)job.samples_done, active, now - start );
+    }
+    if ( render_stop_requested || job.cancelled ){
+      render_log( log_file, "Stopped\n" );
+      stopped = true;
+      break;
+    }
+    if ( job.deadline > 0 && now >= job.deadline ){
+      render_log( log_file, "Time budget reached\n" );
+      stopped = job.samples_done < opts.samples;
+      break;
+    }
+    if ( opts.write_interval > 0 &&
+         now - last_write >= opts.write_interval &&
+         job.samples_done < opts.samples )
+    {
+      framebuffer_write_png( *job.fb, output );
+      last_write = now;
+    }
+    if ( checkpoint && now - last_checkpoint >= opts.checkpoint_interval &&
+         job.samples_done < opts.samples )
+    {
+      checkpoint_write( checkpoint, job, opts, seed );
+      last_checkpoint = now;
+    }
+  }
+  if ( checkpoint && stopped && checkpoint_write( checkpoint, job, opts,
+                                                  seed ) )
+  {
+    render_log( log_file, "Wrote checkpoint %s\n", checkpoint );
+  }
+  return !stopped;
+}
+
+// --out for a single scene, ./dir/dump_file3.dat ->
+// <output_dir>/dump_file3.png in a batch
+void scene_output_path( char *buff, size_t size,
+                        const RenderOptions &opts, uint index, bool batch )
+{
+  if ( !batch ){
+    snprintf( buff, size, "%s", opts.output );
+    return;
+  }
+  const char *scene = opts.scenes[index];
+  const char *name = strrchr( scene, '/' );
+  name = name ? name + 1 : scene;
+  const char *ext = strrchr( name, '.' );
+  int len = ext ? (int)( ext - name ) : (int)strlen( name );
+  snprintf( buff, size, "%s/%.*s.png", opts.output_dir, len, name );
+}
+
+// Distributed rendering. A coordinator ( --coordinator ADDR ) loads the
+// dump, sends it to every worker ( --worker ADDR ) that connects and
+// deals out tiles. Workers render whole tiles with all the samples and
+// send back the float sums, with a DIST_PROGRESS message every
+// DistJob::heartbeat seconds meanwhile, so that a long tile doesn't look
+// like a dead worker. A tile always renders with its own stream,
+// so it gives the same result on any worker and the image is the same
+// as a local render with the same seed. Tiles of workers that
+// disconnect or stop answering go back to the queue, and once the
+// queue is empty idle workers get copies of tiles still out on others,
+// so a slow worker can not hold up the end of the frame. The
+// coordinator gives up once it has been left without workers.
+#define DIST_VERSION 2
+
+// Spawned workers keep trying to connect for this long
+#define DIST_CONNECT_SECONDS 10
+
+enum DistMessageType {
+  DIST_HELLO = 1, // worker -> coordinator, DistHello
+  DIST_JOB,       // DistJob followed by the dump file
+  DIST_ASSIGN,    // uint32 tile indices
+  DIST_RESULT,    // worker -> coordinator, DistTileResult
+  DIST_DONE,      // no payload, the worker exits
+  DIST_PROGRESS   // worker -> coordinator, no payload, tiles are rendering
+};
+
+struct DistHello {
+  uint32 version;
+  int32 threads;
+};
+
+struct DistJob {
+  uint64 seed;
+  uint64 stream;
+  uint64 samples;
+  int32 nx, ny;
+  int32 max_depth;
+  uint32 tile_count;
+  float heartbeat; // seconds between DIST_PROGRESS messages
+};
+
+// Pixels of the tile row by row, edge tiles leave the end unused
+struct DistTileResult {
+  uint32 tile;
+  v3 accum[ TILE_SIZE * TILE_SIZE ];
+  uint32 samples[ TILE_SIZE * TILE_SIZE ];
+  float lum_sq[ TILE_SIZE * TILE_SIZE ];
+};
+
+// Sends DIST_PROGRESS while the worker's tiles render
+struct DistHeartbeat {
+  int fd;
+  float interval;
+  std::mutex lock;
+  std::condition_variable wake;
+  bool stop;
+};
+
+static void dist_heartbeat_thread( DistHeartbeat *hb ){
+  std::unique_lock<std::mutex> guard( hb->lock );
+  while ( !hb->wake.wait_for( guard,
+                              std::chrono::duration<float>( hb->interval ),
+                              [hb]{ return hb->stop; } ) )
+  {
+    if ( !net_send_message( hb->fd, DIST_PROGRESS, NULL, 0 ) ) break;
+  }
+}
+
+int worker_main(
+    const char *addr,
+    int thread_count,
+    const BVHBuildOptions &bvh_options )
+{
+  // The coordinator may still be starting up
+  int fd = -1;
+  for ( int attempt = 0; attempt < 100 && fd < 0; attempt++ ){
+    fd = net_connect( addr );
+    if ( fd < 0 ) usleep( 100 * 1000 );
+  }
+  if ( fd < 0 ){
+    fprintf( stderr, "%s, ", addr );
+    perror( "Unable to connect to the coordinator! " );
+    return 1;
+  }
+  DistHello hello = { DIST_VERSION, thread_count };
+  if ( !net_send_message( fd, DIST_HELLO, &hello, sizeof( hello ) ) ){
+    fprintf( stderr, "Unable to send to the coordinator\n" );
+    close( fd );
+    return 1;
+  }
+
+  ThreadPool *pool = thread_pool_create( thread_count );
+  Scene *scene = scene_create( bvh_options );
+  Arena perlin_arena = new_arena();
+  Perlin perlin;
+  Framebuffer fb = {};
+  RenderJob job;
+  job.tiles = NULL;
+  job.fb = &fb;
+  PRNG *tile_rngs = NULL; // streams of the tiles before any sample
+  DistTileResult *result = new DistTileResult;
+  uint8 *payload = NULL;
+  bool have_job = false;
+  float heartbeat = 1.0f;
+  int ret = 1;
+
+  for ( ;; ){
+    NetHeader header;
+    if ( !net_recv_message( fd, header, payload ) ){
+      fprintf( stderr, "Lost the connection to the coordinator\n" );
+      break;
+    }
+    if ( header.type == DIST_DONE ){
+      ret = 0;
+      break;
+    }
+
+    if ( header.type == DIST_JOB ){
+      if ( header.size < sizeof( DistJob ) ) break;
+      DistJob dj;
+      memcpy( &dj, payload, sizeof( dj ) );
+      PRNG base = render_init_random( dj.seed, dj.stream, &perlin_arena,
+                                      perlin );
+      have_job = scene_load_memory( *scene, payload + sizeof( dj ),
+                                    header.size - sizeof( dj ),
+                                    "<coordinator>", &perlin, pool );
+      if ( !have_job ) break;
+      render_job_setup( job, scene, dj.ny, base );
+      if ( job.nx != dj.nx || array_length( job.tiles ) != dj.tile_count ){
+        fprintf( stderr, "Image size differs from the coordinator's\n" );
+        break;
+      }
+      job.pass_samples = (uint32)MIN( dj.samples, (uint64)UINT32_MAX );
+      job.max_depth = dj.max_depth;
+      job.adaptive = false;
+      job.deadline = 0;
+      job.report_progress = false;
+      heartbeat = dj.heartbeat;
+      if ( tile_rngs ) array_clear( tile_rngs );
+      for ( uint i = 0; i < dj.tile_count; i++ ){
+        array_push( tile_rngs, job.tiles[i].rng );
+      }
+      printf( "Worker: %dx%d, %u tiles, %" PRIu64 " spp\n",
+              job.nx, job.ny, dj.tile_count, dj.samples );
+      continue;
+    }
+
+    if ( header.type != DIST_ASSIGN || !have_job ) break;
+    uint32 *tiles = ( uint32 *)payload;
+    uint count = header.size / sizeof( uint32 );
+    bool valid = true;
+    for ( uint i = 0; i < count; i++ ){
+      if ( tiles[i] >= array_length( job.tiles ) ){
+        valid = false;
+        break;
+      }
+      // A tile may come back after a reassignment, start it over
+      RenderTile &tile = job.tiles[ tiles[i] ];
+      tile.rng = tile_rngs[ tiles[i] ];
+      tile.passes_done = 0;
+      for ( int y = tile.y0; y < tile.y1; y++ ){
+        int p = y * job.nx + tile.x0;
+        int w = tile.x1 - tile.x0;
+        memset( fb.accum + p, 0, w * sizeof( v3 ) );
+        memset( fb.samples + p, 0, w * sizeof( uint32 ) );
+        memset( fb.lum_sq + p, 0, w * sizeof( float ) );
+      }
+    }
+    if ( !valid ) break;
+    // tiles points into payload, copy before reusing it
+    uint32 *list = ( uint32 *)malloc( MAX( count, 1u ) * sizeof( uint32 ) );
+    memcpy( list, tiles, count * sizeof( uint32 ) );
+    DistHeartbeat hb;
+    hb.fd = fd;
+    hb.interval = heartbeat;
+    hb.stop = false;
+    std::thread beat( dist_heartbeat_thread, &hb );
+    render_tiles( pool, job, list, count );
+    {
+      std::lock_guard<std::mutex> guard( hb.lock );
+      hb.stop = true;
+    }
+    hb.wake.notify_one();
+    beat.join();
+
+    bool sent = true;
+    for ( uint i = 0; i < count && sent; i++ ){
+      RenderTile &tile = job.tiles[ list[i] ];
+      int w = tile.x1 - tile.x0;
+      result->tile = list[i];
+      for ( int y = tile.y0; y < tile.y1; y++ ){
+        int p = y * job.nx + tile.x0;
+        int r = ( y - tile.y0 ) * w;
+        memcpy( result->accum + r, fb.accum + p, w * sizeof( v3 ) );
+        memcpy( result->samples + r, fb.samples + p, w * sizeof( uint32 ) );
+        memcpy( result->lum_sq + r, fb.lum_sq + p, w * sizeof( float ) );
+      }
+      sent = net_send_message( fd, DIST_RESULT, result, sizeof( *result ) );
+    }
+    free( list );
+    if ( !sent ){
+      fprintf( stderr, "Lost the connection to the coordinator\n" );
+      break;
+    }
+  }
+
+  close( fd );
+  thread_pool_destroy( pool );
+  scene_destroy( scene );
+  framebuffer_free( fb );
+  array_free( job.tiles );
+  array_free( tile_rngs );
+  array_free( payload );
+  arena_free( &perlin_arena );
+  delete result;
+  return ret;
+}
+
+struct DistWorker {
+  int fd;
+  int threads;
+  std::vector<uint32> assigned; // tiles sent and not returned yet
+  double last_seen;             // time of the last message
+};
+
+struct DistTile {
+  bool done;
+  int copies;         // workers the tile is assigned to
+  double assign_time; // of the last assignment
+};
+
+struct Coordinator {
+  std::vector<DistWorker> workers;
+  std::vector<DistTile> tiles;
+  std::deque<uint32> pending;
+  int tiles_done;
+};
+
+static void coordinator_drop_worker(
+    Coordinator &c,
+    size_t index,
+    const char *reason )
+{
+  DistWorker &w = c.workers[index];
+  int requeued = 0;
+  for ( uint32 t : w.assigned ){
+    DistTile &tile = c.tiles[t];
+    if ( tile.done ) continue;
+    if ( --tile.copies == 0 ){
+      c.pending.push_front( t );
+      requeued++;
+    }
+  }
+  printf( "Worker %d %s, %d tiles requeued\n", w.fd, reason, requeued );
+  close( w.fd );
+  c.workers.erase( c.workers.begin() + index );
+}
+
+// Gives an idle worker up to two tiles per thread. Without pending
+// tiles it gets copies of the tiles that have been out the longest.
+static bool coordinator_assign( Coordinator &c, DistWorker &w, double now ){
+  uint batch = 2 * MAX( w.threads, 1 );
+  std::vector<uint32> list;
+  while ( list.size() < batch && !c.pending.empty() ){
+    uint32 t = c.pending.front();
+    c.pending.pop_front();
+    if ( !c.tiles[t].done ) list.push_back( t );
+  }
+  while ( list.size() < batch ){
+    int oldest = -1;
+    for ( size_t t = 0; t < c.tiles.size(); t++ ){
+      const DistTile &tile = c.tiles[t];
+      if ( tile.done || tile.copies != 1 ) continue;
+      if ( oldest < 0 || tile.assign_time < c.tiles[oldest].assign_time ){
+        oldest = (int)t;
+      }
+    }
+    if ( oldest < 0 ) break;
+    list.push_back( oldest );
+    c.tiles[oldest].copies++;
+  }
+  if ( list.empty() ) return true;
+  for ( uint32 t : list ){
+    if ( c.tiles[t].copies == 0 ) c.tiles[t].copies = 1;
+    c.tiles[t].assign_time = now;
+    w.assigned.push_back( t );
+  }
+  w.last_seen = now;
+  return net_send_message( w.fd, DIST_ASSIGN, list.data(),
+                           list.size() * sizeof( uint32 ) );
+}
+
+// Hands out the tiles of the loaded scene to the workers connecting to
+// listen_fd until the image is done, then writes it
+static bool coordinator_run(
+    const RenderOptions &opts,
+    uint64 seed,
+    Scene *scene,
+    PRNG base,
+    int listen_fd,
+    const uint8 *dump,
+    size_t dump_size )
+{
+  const char *path = opts.scenes[0];
+  Framebuffer fb = {};
+  RenderJob job;
+  job.tiles = NULL;
+  job.fb = &fb;
+  render_job_setup( job, scene, opts.height, base );
+
+  DistJob dj;
+  dj.seed = seed;
+  dj.stream = opts.stream;
+  dj.samples = opts.samples;
+  dj.nx = job.nx;
+  dj.ny = job.ny;
+  dj.max_depth = opts.max_depth;
+  dj.tile_count = array_length( job.tiles );
+  dj.heartbeat = opts.worker_timeout / 4;
+
+  Coordinator c;
+  c.tiles.resize( dj.tile_count, DistTile{ false, 0, 0.0 } );
+  for ( uint32 t = 0; t < dj.tile_count; t++ ) c.pending.push_back( t );
+  c.tiles_done = 0;
+  printf( "Coordinating %s on %s, %dx%d, %u tiles, %" PRIu64 " spp\n",
+          path, opts.coordinator, job.nx, job.ny, dj.tile_count,
+          opts.samples );
+
+  double start = get_time();
+  // Since when no worker is connected, from the start the spawned ones
+  // get a while to connect
+  double idle_since = start;
+  double idle_limit = opts.spawn > 0 ? MAX( opts.worker_timeout,
+                                             DIST_CONNECT_SECONDS ) : -1;
+  bool failed = false;
+  int percent_reported = 0;
+  DistTileResult *result = new DistTileResult;
+  uint8 *payload = NULL;
+  std::vector<pollfd> fds;
+  while ( c.tiles_done < (int)dj.tile_count ){
+    fds.clear();
+    fds.push_back( pollfd{ listen_fd, POLLIN, 0 } );
+    for ( DistWorker &w : c.workers ){
+      fds.push_back( pollfd{ w.fd, POLLIN, 0 } );
+    }
+    if ( poll( fds.data(), fds.size(), 500 ) < 0 && errno != EINTR ){
+      perror( "poll failed! " );
+      failed = true;
+      break;
+    }
+    double now = get_time();
+
+    // Results first, fds[i + 1] belongs to workers[i] until one is
+    // dropped, so go backwards
+    for ( size_t i = c.workers.size(); i-- > 0; ){
+      if ( !fds[i + 1].revents ) continue;
+      DistWorker &w = c.workers[i];
+      NetHeader header;
+      if ( !net_recv_message( w.fd, header, payload ) ){
+        coordinator_drop_worker( c, i, "disconnected" );
+        continue;
+      }
+      if ( header.type == DIST_PROGRESS ){
+        w.last_seen = now;
+        continue;
+      }
+      if ( header.type != DIST_RESULT ||
+           header.size != sizeof( DistTileResult ) )
+      {
+        coordinator_drop_worker( c, i, "disconnected" );
+        continue;
+      }
+      memcpy( result, payload, sizeof( *result ) );
+      w.last_seen = now;
+      uint32 t = result->tile;
+      if ( t >= dj.tile_count ){
+        coordinator_drop_worker( c, i, "sent an invalid tile" );
+        continue;
+      }
+      for ( size_t k = 0; k < w.assigned.size(); k++ ){
+        if ( w.assigned[k] == t ){
+          w.assigned.erase( w.assigned.begin() + k );
+          break;
+        }
+      }
+      DistTile &tile = c.tiles[t];
+      if ( tile.done ) continue;
+      tile.done = true;
+      c.tiles_done++;
+      RenderTile &rt = job.tiles[t];
+      int tw = rt.x1 - rt.x0;
+      for ( int y = rt.y0; y < rt.y1; y++ ){
+        int p = y * job.nx + rt.x0;
+        int r = ( y - rt.y0 ) * tw;
+        memcpy( fb.accum + p, result->accum + r, tw * sizeof( v3 ) );
+        memcpy( fb.samples + p, result->samples + r, tw * sizeof( uint32 ) );
+        memcpy( fb.lum_sq + p, result->lum_sq + r, tw * sizeof( float ) );
+      }
+      int percent = ( c.tiles_done * 20 / dj.tile_count ) * 5;
+      if ( percent > percent_reported ){
+        percent_reported = percent;
+        printf( "Ray tracing %d percent completed, %d workers\n",
+                percent, (int)c.workers.size() );
+      }
+    }
+
+    if ( fds[0].revents & POLLIN ){
+      int fd = net_accept( listen_fd );
+      NetHeader header;
+      DistHello hello;
+      if ( fd >= 0 && net_recv_message( fd, header, payload ) &&
+           header.type == DIST_HELLO && header.size == sizeof( hello ) &&
+           ( memcpy( &hello, payload, sizeof( hello ) ),
+             hello.version == DIST_VERSION ) &&
+           net_send_message( fd, DIST_JOB, &dj, sizeof( dj ), dump,
+                             dump_size ) )
+      {
+        DistWorker w;
+        w.fd = fd;
+        w.threads = hello.threads;
+        w.last_seen = now;
+        c.workers.push_back( w );
+        printf( "Worker %d connected, %d threads\n", fd, hello.threads );
+      } else if ( fd >= 0 ){
+        fprintf( stderr, "Rejected a worker\n" );
+        close( fd );
+      }
+    }
+
+    for ( size_t i = c.workers.size(); i-- > 0; ){
+      DistWorker &w = c.workers[i];
+      if ( !w.assigned.empty() &&
+           now - w.last_seen > opts.worker_timeout )
+      {
+        coordinator_drop_worker( c, i, "timed out" );
+      }
+    }
+    if ( c.tiles_done == (int)dj.tile_count ) break;
+    for ( size_t i = c.workers.size(); i-- > 0; ){
+      DistWorker &w = c.workers[i];
+      if ( w.assigned.empty() && !coordinator_assign( c, w, now ) ){
+        coordinator_drop_worker( c, i, "disconnected" );
+      }
+    }
+
+    // Without spawned workers, wait for the first one as long as it
+    // takes, but not for a replacement of the last one
+    if ( !c.workers.empty() ){
+      idle_since = -1;
+      idle_limit = opts.worker_timeout;
+    } else if ( idle_since < 0 ){
+      idle_since = now;
+    } else if ( idle_limit >= 0 && now - idle_since > idle_limit ){
+      fprintf( stderr, "No workers left for %.1f s, giving up with %d of"
+                       " %u tiles done\n",
+               now - idle_since, c.tiles_done, dj.tile_count );
+      failed = true;
+      break;
+    }
+  }
+
+  for ( DistWorker &w : c.workers ){
+    net_send_message( w.fd, DIST_DONE, NULL, 0 );
+    close( w.fd );
+  }
+
+  bool ok = !failed;
+  if ( ok ){
+    printf( "Rendered in %.2f s\n", get_time() - start );
+    ok = framebuffer_write_png( fb, opts.output );
+    if ( opts.write_accum ){
+      char accum[1040];
+      snprintf( accum, sizeof( accum ), "%s.acc", opts.output );
+      ok = framebuffer_write_accum( fb, accum ) && ok;
+    }
+    printf( "Wrote %s\n", opts.output );
+  }
+
+  delete result;
+  array_free( payload );
+  array_free( job.tiles );
+  framebuffer_free( fb );
+  return ok;
+}
+
+int coordinator_main( const RenderOptions &opts, uint64 seed ){
+  if ( array_length( opts.scenes ) != 1 ){
+    fprintf( stderr, "The coordinator renders a single scene\n" );
+    return 1;
+  }
+  const char *path = opts.scenes[0];
+  size_t dump_size;
+  uint8 *dump = read_binary_file( path, dump_size );
+  if ( !dump ) return 1;
+
+  // Only the image size and the tile layout are needed here. The scene
+  // is checked before any worker is spawned.
+  Arena perlin_arena = new_arena();
+  Perlin perlin;
+  PRNG base = render_init_random( seed, opts.stream, &perlin_arena, perlin );
+  Scene *scene = scene_create( opts.bvh );
+  int listen_fd = -1;
+  if ( scene_load_memory( *scene, dump, dump_size, path, &perlin, NULL ) ){
+    listen_fd = net_listen( opts.coordinator );
+  }
+  std::vector<pid_t> children;
+  bool ok = false;
+  if ( listen_fd >= 0 ){
+    for ( int i = 0; i < opts.spawn; i++ ){
+      pid_t pid = fork();
+      if ( pid == 0 ){
+        close( listen_fd );
+        exit( worker_main( opts.coordinator, opts.thread_count,
+                            opts.bvh ) );
+      }
+      if ( pid < 0 ){
+        perror( "fork failed! " );
+        break;
+      }
+      children.push_back( pid );
+    }
+    ok = coordinator_run( opts, seed, scene, base, listen_fd, dump,
+                          dump_size );
+    close( listen_fd );
+    if ( net_is_unix( opts.coordinator ) ) unlink( opts.coordinator + 5 );
+  }
+  for ( pid_t pid : children ){
+    waitpid( pid, NULL, 0 );
+  }
+
+  scene_destroy( scene );
+  arena_free( &perlin_arena );
+  free( dump );
+  return ok ? 0 : 1;
+}
+
+// Render daemon ( --daemon ADDR ). Jobs are submitted, listed and
+// cancelled over the socket with one line of tab separated fields per
+// connection:
+//   submit  scene=PATH out=PATH [spp=N] [time=S] [height=N]
+//           [depth=N] [priority=P]        -> ok ID
+//   status  [ID]                          -> one line per job, then end
+//   cancel  ID                            -> ok
+// The thread pool, the perlin tables and the loaded scenes with their
+// BVHs stay around between jobs. Up to --max-jobs jobs render at the
+// same time and share the pool, their tiles are queued with the job's
+// priority so a preview gets the threads ahead of a final render.
+// Finished jobs are listed until there are more than
+// DAEMON_KEEP_FINISHED of them or they are DAEMON_KEEP_SECONDS old.
+enum DaemonJobState {
+  JOB_QUEUED,
+  JOB_RUNNING,
+  JOB_DONE,
+  JOB_FAILED,
+  JOB_CANCELLED
+};
+
+static const char *daemon_state_names[] = {
+  "queued", "running", "done", "failed", "cancelled"
+};
+
+#define DAEMON_DEFAULT_PRIORITY 1
+#define DAEMON_KEEP_FINISHED 64
+#define DAEMON_KEEP_SECONDS 3600.0
+// A client gets this long to send its request line, the scheduling
+// loop waits on nothing else
+#define DAEMON_REQUEST_SECONDS 0.2
+
+struct CachedScene {
+  char path[2048];
+  time_t mtime;
+  off_t size;
+  Scene *scene;
+  int refs;
+  double last_used;
+};
+
+struct DaemonJob {
+  int id;
+  DaemonJobState state;
+  int priority;
+  RenderOptions opts;
+  char scene_path[2048];
+  char output[2048];
+  CachedScene *scene;
+  Framebuffer fb;
+  RenderJob job;
+  std::thread thread;
+  std::atomic<bool> cancel_requested;
+  std::atomic<bool> finished;
+  double submit_time, start_time, end_time;
+};
+
+struct Daemon {
+  const RenderOptions *opts;
+  ThreadPool *pool;
+  Arena perlin_arena;
+  Perlin perlin;
+  PRNG base;
+  uint64 seed;
+
+  std::mutex lock; // jobs and scenes
+  std::vector<DaemonJob *> jobs;
+  std::vector<CachedScene *> scenes;
+  int next_id;
+};
+
+static void daemon_trim_scenes( Daemon *d ){
+  for ( ;; ){
+    int victim = -1;
+    for ( size_t i = 0; i < d->scenes.size(); i++ ){
+      if ( d->scenes[i]->refs ) continue;
+      if ( victim < 0 ||
+           d->scenes[i]->last_used < d->scenes[victim]->last_used )
+      {
+        victim = (int)i;
+      }
+    }
+    if ( victim < 0 || d->scenes.size() <= (size_t)d->opts->scene_cache ){
+      return;
+    }
+    CachedScene *cs = d->scenes[victim];
+    scene_destroy( cs->scene );
+    delete cs;
+    d->scenes.erase( d->scenes.begin() + victim );
+  }
+}
+
+// Returns the cached scene, loading it and building the BVH if the
+// file is new or has changed since it was loaded
+static CachedScene *daemon_acquire_scene( Daemon *d, const char *path ){
+  struct stat st;
+  if ( stat( path, &st ) != 0 ){
+    fprintf( stderr, "%s, ", path );
+    perror( "Unable to open scene file! " );
+    return NULL;
+  }
+  {
+    std::lock_guard<std::mutex> guard( d->lock );
+    for ( CachedScene *cs : d->scenes ){
+      if ( !strcmp( cs->path, path ) && cs->mtime == st.st_mtime &&
+           cs->size == st.st_size )
+      {
+        cs->refs++;
+        cs->last_used = get_time();
+        return cs;
+      }
+    }
+  }
+
+  // Loaded without the lock, status requests are not held up by it
+  double start = get_time();
+  CachedScene *cs = new CachedScene;
+  snprintf( cs->path, sizeof( cs->path ), "%s", path );
+  cs->mtime = st.st_mtime;
+  cs->size = st.st_size;
+  cs->scene = scene_create( d->opts->bvh );
+  cs->refs = 1;
+  cs->last_used = get_time();
+  if ( !scene_load( *cs->scene, path, &d->perlin, d->pool ) ){
+    scene_destroy( cs->scene );
+    delete cs;
+    return NULL;
+  }
+  printf( "Loaded %s in %.3f s ( BVH %.3f s )\n", path, get_time() - start,
+          cs->scene->bvh_build_time );
+
+  std::lock_guard<std::mutex> guard( d->lock );
+  for ( CachedScene *other : d->scenes ){
+    // an older version of the file is not used by new jobs anymore
+    if ( !strcmp( other->path, path ) ) other->last_used = 0;
+  }
+  d->scenes.push_back( cs );
+  daemon_trim_scenes( d );
+  return cs;
+}
+
+static void daemon_job_thread( Daemon *d, DaemonJob *dj ){
+  CachedScene *cs = daemon_acquire_scene( d, dj->scene_path );
+  bool ok = false;
+  if ( cs ){
+    dj->scene = cs;
+    dj->fb = {};
+    dj->job.fb = &dj->fb;
+    dj->job.tiles = NULL;
+    render_job_setup( dj->job, cs->scene, dj->opts.height, d->base );
+    dj->job.priority = dj->priority;
+    dj->job.cancelled = dj->cancel_requested.load();
+    render_progressive( d->pool, dj->job, dj->opts, dj->output, NULL,
+                        d->seed );
+    ok = !dj->job.cancelled && framebuffer_write_png( dj->fb, dj->output );
+  }
+
+  std::lock_guard<std::mutex> guard( d->lock );
+  if ( dj->cancel_requested ){
+    dj->state = JOB_CANCELLED;
+  } else {
+    dj->state = ok ? JOB_DONE : JOB_FAILED;
+  }
+  dj->end_time = get_time();
+  if ( cs ){
+    cs->refs--;
+    daemon_trim_scenes( d );
+  }
+  printf( "Job %d %s after %.2f s\n", dj->id, daemon_state_names[ dj->state ],
+          dj->end_time - dj->start_time );
+  dj->finished = true;
 }
-void print_rect_info( Rectangle *r ){
-  fprintf(stdout,"Normal: " );
-  print_v3( r->n );
-  fprintf( stdout, "\ncorner point: " );
-  print_v3( r->p0 );
 
-  fprintf( stdout, "\nVector s1: " );
-  print_v3( r->s1 );
-  fprintf( stdout, "\nVector s2: " );
-  print_v3( r->s2 );
+// Drops the oldest finished jobs beyond the ones kept for --status.
+// The jobs are in the order of their ids, so the newest are kept.
+static void daemon_reap_jobs( Daemon *d ){
+  double now = get_time();
+  int finished = 0;
+  for ( DaemonJob *dj : d->jobs ){
+    finished += dj->state > JOB_RUNNING && !dj->thread.joinable();
+  }
+  size_t kept = 0;
+  for ( DaemonJob *dj : d->jobs ){
+    if ( dj->state > JOB_RUNNING && !dj->thread.joinable() &&
+         ( finished > DAEMON_KEEP_FINISHED ||
+           now - dj->end_time > DAEMON_KEEP_SECONDS ) )
+    {
+      finished--;
+      delete dj;
+      continue;
+    }
+    d->jobs[ kept++ ] = dj;
+  }
+  d->jobs.resize( kept );
+}
 
-  fprintf( stdout, "\nl1 = %f, l2 = %f\n", r->l1, r->l2 );
+// Joins finished jobs and starts the queued ones, highest priority
+// first. A job starts while fewer than max_jobs jobs of the same or a
+// higher priority are running, so a preview does not wait for the
+// finals in front of it, it only takes the threads away from them.
+static void daemon_schedule( Daemon *d ){
+  std::lock_guard<std::mutex> guard( d->lock );
+  for ( DaemonJob *dj : d->jobs ){
+    if ( dj->finished && dj->thread.joinable() ){
+      dj->thread.join();
+      framebuffer_free( dj->fb );
+      array_free( dj->job.tiles );
+    }
+  }
+  daemon_reap_jobs( d );
+  for ( ;; ){
+    DaemonJob *next = NULL;
+    for ( DaemonJob *dj : d->jobs ){
+      if ( dj->state == JOB_QUEUED &&
+           ( !next || dj->priority > next->priority ) )
+      {
+        next = dj;
+      }
+    }
+    if ( !next ) break;
+    int running = 0;
+    for ( DaemonJob *dj : d->jobs ){
+      running += dj->state == JOB_RUNNING && dj->priority >= next->priority;
+    }
+    if ( running >= d->opts->max_jobs ) break;
+    next->state = JOB_RUNNING;
+    next->start_time = get_time();
+    next->thread = std::thread( daemon_job_thread, d, next );
+  }
+}
 
+// Splits the request line at the tabs, returns the number of fields
+static int daemon_split( char *line, char **fields, int max ){
+  int count = 0;
+  char *save = NULL;
+  for ( char *f = strtok_r( line, "\t\r\n", &save ); f && count < max;
+        f = strtok_r( NULL, "\t\r\n", &save ) )
+  {
+    fields[ count++ ] = f;
+  }
+  return count;
 }
 
-void print_priminfo( PrimInfo *p ){
-  switch ( p->type ){
-    case PrimInfo::SPHERE:
-      fprintf(stdout,"Sphere\n");
-      print_sphere_info( (Sphere *)p->data );
-      break;
-    case PrimInfo::PLANE:
-      fprintf(stdout,"Plane\n" );
-      print_plane_info( (Plane *)p->data );
-      break;
-    case PrimInfo::RECTANGLE:
-      fprintf(stdout,"Rectangle\n" );
-      print_rect_info( (Rectangle *)p->data );
-      break;
+static DaemonJob *daemon_find_job( Daemon *d, int id ){
+  for ( DaemonJob *dj : d->jobs ){
+    if ( dj->id == id ) return dj;
   }
+  return NULL;
 }
 
-void world_decode_sphere_data( 
-    World &w,
-    const DumpObjectData &data,
-    Texture *textures,
-    Material *materials)
-{
-  
+static void daemon_format_job( DaemonJob *dj, char *buff, size_t size ){
+  double progress = 0;
+  uint64 samples = dj->state == JOB_RUNNING || dj->finished ?
+                   (uint64)dj->job.samples_done : 0;
+  double elapsed = 0;
+  if ( dj->state == JOB_RUNNING ){
+    elapsed = get_time() - dj->start_time;
+  } else if ( dj->state != JOB_QUEUED && dj->start_time > 0 ){
+    elapsed = dj->end_time - dj->start_time;
+  }
+  if ( dj->state == JOB_DONE ){
+    progress = 100;
+  } else {
+    progress = 100.0 * samples / dj->opts.samples;
+    if ( dj->opts.time_budget > 0 ){
+      progress = MAX( progress, 100.0 * elapsed / dj->opts.time_budget );
+    }
+    progress = MIN( progress, 99.9 );
+  }
+  snprintf( buff, size, "%d\t%s\t%d\t%.1f%%\t%" PRIu64 " spp\t%.2f s\t%s\t%s\n",
+            dj->id, daemon_state_names[ dj->state ], dj->priority, progress,
+            samples, elapsed, dj->output, dj->scene_path );
 }
 
+// Handles one request, the reply is written to the buffer
+static void daemon_request( Daemon *d, char *line, char *&reply ){
+  char *fields[16];
+  int count = daemon_split( line, fields, 16 );
+  if ( count == 0 ){
+    reply = _string_print( reply, "error empty request\n" );
+    return;
+  }
 
-Texture dump_get_texture( const DumpObjectData &d, Perlin *perlin){
-  Texture t;
-  switch( d.texture_type ){
-    case DumpObjectData::TEXTURE_PLAIN_COLOR:
-      t = create_texture_plain( d.texture_data.color );
-      break;
-    case DumpObjectData::TEXTURE_CHECKER:
-      t = create_texture_checker( d.texture_data.checker_color[0],
-                                  d.texture_data.checker_color[1],
-                                  d.texture_data.freq );
-      break;
-    case DumpObjectData::TEXTURE_MARBLE:
-      t = create_texture_marble( perlin,
-                                 d.texture_data.marble_color);
-      break;
-    default:
-      fprintf( stderr, "Unknown Texture detected!\n" );
-      break;
+  if ( !strcmp( fields[0], "submit" ) ){
+    DaemonJob *dj = new DaemonJob;
+    dj->opts = *d->opts;
+    dj->opts.samples = 100;
+    dj->opts.time_budget = 0;
+    dj->opts.adaptive = false;
+    dj->opts.write_interval = 0;
+    dj->opts.checkpoint_interval = 0;
+    dj->opts.quiet = true;
+    dj->priority = DAEMON_DEFAULT_PRIORITY;
+    dj->scene_path[0] = 0;
+    dj->output[0] = 0;
+    bool spp_given = false;
+    for ( int i = 1; i < count; i++ ){
+      char *key = fields[i];
+      char *val = strchr( key, '=' );
+      if ( !val ) continue;
+      *val++ = 0;
+      if ( !strcmp( key, "scene" ) ){
+        snprintf( dj->scene_path, sizeof( dj->scene_path ), "%s", val );
+      } else if ( !strcmp( key, "out" ) ){
+        snprintf( dj->output, sizeof( dj->output ), "%s", val );
+      } else if ( !strcmp( key, "spp" ) ){
+        dj->opts.samples = strtoull( val, NULL, 0 );
+        spp_given = true;
+      } else if ( !strcmp( key, "time" ) ){
+        dj->opts.time_budget = atof( val );
+      } else if ( !strcmp( key, "height" ) ){
+        dj->opts.height = atoi( val );
+      } else if ( !strcmp( key, "depth" ) ){
+        dj->opts.max_depth = atoi( val );
+      } else if ( !strcmp( key, "priority" ) ){
+        dj->priority = CLAMP( atoi( val ), 0, THREAD_POOL_PRIORITIES - 1 );
+      }
+    }
+    if ( !spp_given && dj->opts.time_budget > 0 ){
+      dj->opts.samples = UINT32_MAX;
+    }
+    dj->opts.pass_samples = (uint32)MIN( (uint64)4, dj->opts.samples );
+    if ( !dj->scene_path[0] || !dj->output[0] || dj->opts.samples == 0 ||
+         dj->opts.height <= 0 || dj->opts.max_depth <= 0 )
+    {
+      reply = _string_print( reply, "error submit needs scene= and out=,"
+                                    " spp, height and depth must be"
+                                    " positive\n" );
+      delete dj;
+      return;
+    }
+    dj->state = JOB_QUEUED;
+    dj->scene = NULL;
+    dj->fb = {};
+    dj->job.tiles = NULL;
+    dj->job.samples_done = 0;
+    dj->cancel_requested = false;
+    dj->finished = false;
+    dj->submit_time = get_time();
+    dj->start_time = dj->end_time = 0;
+    std::lock_guard<std::mutex> guard( d->lock );
+    dj->id = d->next_id++;
+    d->jobs.push_back( dj );
+    printf( "Job %d queued, priority %d, %s\n", dj->id, dj->priority,
+            dj->scene_path );
+    reply = _string_print( reply, "ok %d\n", dj->id );
+    return;
   }
-  return t;
+
+  if ( !strcmp( fields[0], "status" ) ){
+    std::lock_guard<std::mutex> guard( d->lock );
+    int id = count > 1 ? atoi( fields[1] ) : -1;
+    char buff[4400];
+    for ( DaemonJob *dj : d->jobs ){
+      if ( id >= 0 && dj->id != id ) continue;
+      daemon_format_job( dj, buff, sizeof( buff ) );
+      reply = _string_app_print( reply, "%s", buff );
+    }
+    reply = _string_app_print( reply, "end\n" );
+    return;
+  }
+
+  if ( !strcmp( fields[0], "cancel" ) && count > 1 ){
+    std::lock_guard<std::mutex> guard( d->lock );
+    DaemonJob *dj = daemon_find_job( d, atoi( fields[1] ) );
+    if ( !dj ){
+      reply = _string_print( reply, "error no job %s\n", fields[1] );
+    } else if ( dj->state == JOB_QUEUED ){
+      dj->state = JOB_CANCELLED;
+      dj->end_time = get_time();
+      reply = _string_print( reply, "ok\n" );
+    } else if ( dj->state == JOB_RUNNING ){
+      dj->cancel_requested = true;
+      dj->job.cancelled = true;
+      reply = _string_print( reply, "ok\n" );
+    } else {
+      reply = _string_print( reply, "error job %d is %s\n", dj->id,
+                             daemon_state_names[ dj->state ] );
+    }
+    return;
+  }
+
+  reply = _string_print( reply, "error unknown request %s\n", fields[0] );
 }
-Material dump_get_material(
-    const DumpObjectData &d,
-    Texture &tex )
-{
-  Material m;
-  switch( d.material_type ){
-    case DumpObjectData::MATERIAL_DIFFUSE_LIGHT:
-      m = create_diffuse_light( d.material_data.diff_light_color );
-      break;
-    case DumpObjectData::MATERIAL_PURE_DIFFUSE:
-      m = create_material_pure_diffuse( tex );
-      break;
-    case DumpObjectData::MATERIAL_METALLIC:
-      m = create_material_metallic( tex, d.material_data.fuzz );
-      break;
-    case DumpObjectData::MATERIAL_GLASS:
-      printf("Creating glass material!\n");
-      m = create_material_glass( tex, d.material_data.ri);
+
+// Reads one line from the client and answers it. The reads wait in
+// poll() for at most DAEMON_REQUEST_SECONDS in all, so a client that
+// connects and sends nothing does not hold up the other requests and
+// the scheduling of the jobs.
+static void daemon_handle_client( Daemon *d, int fd ){
+  char line[8192];
+  size_t len = 0;
+  double deadline = get_time() + DAEMON_REQUEST_SECONDS;
+  bool complete = false;
+  while ( len < sizeof( line ) - 1 ){
+    int wait = (int)( 1000.0 * ( deadline - get_time() ) );
+    pollfd p = { fd, POLLIN, 0 };
+    if ( wait <= 0 || poll( &p, 1, wait ) <= 0 ) break;
+    ssize_t n = recv( fd, line + len, sizeof( line ) - 1 - len,
+                      MSG_DONTWAIT );
+    if ( n < 0 && ( errno == EINTR || errno == EAGAIN ) ) continue;
+    if ( n <= 0 ){
+      complete = len > 0;
       break;
-    case DumpObjectData::MATERIAL_SPOT_LIGHT:
-      m = create_spot_light( d.material_data.spot_light_color, 
-                             d.material_data.angle );
+    }
+    len += n;
+    if ( memchr( line, '\n', len ) ){
+      complete = true;
       break;
+    }
   }
-  return m;
+  line[len] = 0;
+  if ( !complete ){
+    const char *msg = "error incomplete request\n";
+    net_send_all( fd, msg, strlen( msg ) );
+    return;
+  }
+  char *reply = _init_string( NULL );
+  daemon_request( d, line, reply );
+  net_send_all( fd, reply, strlen( reply ) );
+  str_free( reply );
 }
 
-void world_get_from_file(
-    const char *path,
-    Texture *textures,
-    Material *materials,
-    Perlin *perlin,
-    World &w, 
-    Camera &camera,
-    float *aspect_ratio )
-{
-  FILE *fp = fopen( path, "rb" );
-  
-  DumpCameraData camera_data;
-  fread( &camera_data, sizeof(camera_data),1, fp );
+int daemon_main( const RenderOptions &opts, uint64 seed ){
+  int listen_fd = net_listen( opts.daemon );
+  if ( listen_fd < 0 ) return 1;
+  signal( SIGTERM, render_stop_handler );
+  signal( SIGINT, render_stop_handler );
 
-  Camera c(
-      camera_data.look_from,
-      camera_data.look_at,
-      camera_data.z,
-      camera_data.vfov,
-      camera_data.aspect_ratio,
-      camera_data.aperture,
-      camera_data.focal_dist
-  );
-  camera = c;
-  *aspect_ratio = camera_data.aspect_ratio;
-  uint32 data_count;
-  fread( &data_count, sizeof(data_count), 1, fp );
-  DumpObjectData *object_data = array_allocate( DumpObjectData,
-                                         data_count );
-  fread( object_data, sizeof(*object_data), data_count, fp );
+  Daemon *d = new Daemon;
+  d->opts = &opts;
+  d->seed = seed;
+  d->next_id = 1;
+  d->perlin_arena = new_arena();
+  d->base = render_init_random( seed, opts.stream, &d->perlin_arena,
+                                d->perlin );
+  d->pool = thread_pool_create( opts.thread_count );
+  setvbuf( stdout, NULL, _IOLBF, 0 );
+  printf( "Daemon listening on %s, %d threads\n", opts.daemon,
+          opts.thread_count );
 
-  
-  for ( uint i = 0; i < data_count; i++ ){
-    const DumpObjectData &data = object_data[i];
-    array_push( textures, dump_get_texture( data, perlin ) );
-    array_push( materials, dump_get_material( data,
-          textures[ array_length(textures)- 1] ) );
-    Material *m = &materials[ array_length(materials) - 1];
-    switch ( data.type ){
-      case DumpObjectData::RECTANGLE:
-        {
-          Rectangle rect;
-          rect.p0 = data.object_data.p0;
-          rect.s1 = data.object_data.s1;
-          rect.s2 = data.object_data.s2;
-          rect.n = data.object_data.n;
-          rect.l1 = data.object_data.l1;
-          rect.l2 = data.object_data.l2;
-          rect.p1 = rect.p0 + rect.l1 * rect.s1;
-          rect.p2 = rect.p0 + rect.l1 * rect.s1 + rect.l2 * rect.s2;
-          rect.p3 = rect.p0 + rect.l2 * rect.s2;
-          rect.box = rectangle_AABB( rect ) ;
-          rect.m = m;
-          world_add_rectangle( w, rect );
-        }
-        break;
+  while ( !render_stop_requested ){
+    pollfd p = { listen_fd, POLLIN, 0 };
+    if ( poll( &p, 1, 100 ) > 0 && ( p.revents & POLLIN ) ){
+      int fd = net_accept( listen_fd );
+      if ( fd >= 0 ){
+        daemon_handle_client( d, fd );
+        close( fd );
+      }
+    }
+    daemon_schedule( d );
+  }
 
-      case DumpObjectData::SPHERE:
-        {
-          Sphere sphere( data.object_data.center, 
-              data.object_data.radius, m );
-          world_add_sphere( w, sphere );
-        }
-        break;
-      default:
-        break;
+  printf( "Shutting down\n" );
+  {
+    std::lock_guard<std::mutex> guard( d->lock );
+    for ( DaemonJob *dj : d->jobs ){
+      dj->cancel_requested = true;
+      dj->job.cancelled = true;
+    }
+  }
+  for ( DaemonJob *dj : d->jobs ){
+    if ( dj->thread.joinable() ) dj->thread.join();
+    framebuffer_free( dj->fb );
+    array_free( dj->job.tiles );
+    delete dj;
+  }
+  for ( CachedScene *cs : d->scenes ){
+    scene_destroy( cs->scene );
+    delete cs;
+  }
+  close( listen_fd );
+  if ( net_is_unix( opts.daemon ) ) unlink( opts.daemon + 5 );
+  thread_pool_destroy( d->pool );
+  arena_free( &d->perlin_arena );
+  delete d;
+  return 0;
+}
+
+// Client side of the daemon requests, prints the reply
+int daemon_send( const char *addr, const char *request ){
+  int fd = net_connect( addr );
+  if ( fd < 0 ){
+    fprintf( stderr, "%s, ", addr );
+    perror( "Unable to connect to the daemon! " );
+    return 1;
+  }
+  bool ok = net_send_all( fd, request, strlen( request ) );
+  bool error = !ok;
+  char buff[4096];
+  bool first = true;
+  ssize_t n;
+  while ( ok && ( n = recv( fd, buff, sizeof( buff ), 0 ) ) > 0 ){
+    if ( first && !strncmp( buff, "error", MIN( n, (ssize_t)5 ) ) ){
+      error = true;
+    }
+    first = false;
+    fwrite( buff, 1, n, stdout );
+  }
+  close( fd );
+  return error ? 1 : 0;
+}
+
+// Relative paths are resolved here, the daemon may run elsewhere
+static void absolute_path( const char *path, char *buff, size_t size ){
+  char cwd[1024];
+  if ( path[0] == '/' || !getcwd( cwd, sizeof( cwd ) ) ){
+    snprintf( buff, size, "%s", path );
+  } else {
+    snprintf( buff, size, "%s/%s", cwd, path );
+  }
+}
+
+int daemon_client_main( const RenderOptions &opts ){
+  char request[8192];
+  if ( opts.client_request == CLIENT_STATUS ){
+    return daemon_send( opts.client_addr, "status\n" );
+  }
+  if ( opts.client_request == CLIENT_CANCEL ){
+    snprintf( request, sizeof( request ), "cancel\t%s\n", opts.cancel_id );
+    return daemon_send( opts.client_addr, request );
+  }
+  int ret = 0;
+  uint scene_count = array_length( opts.scenes );
+  for ( uint s = 0; s < scene_count; s++ ){
+    char output[1024], scene[2048], abs_output[2048];
+    scene_output_path( output, sizeof( output ), opts, s, scene_count > 1 );
+    absolute_path( output, abs_output, sizeof( abs_output ) );
+    absolute_path( opts.scenes[s], scene, sizeof( scene ) );
+    snprintf( request, sizeof( request ),
+              "submit\tscene=%s\tout=%s\tspp=%" PRIu64 "\ttime=%g"
+              "\theight=%d\tdepth=%d\tpriority=%d\n",
+              scene, abs_output, opts.samples, opts.time_budget,
+              opts.height, opts.max_depth, opts.priority );
+    ret |= daemon_send( opts.client_addr, request );
+  }
+  return ret;
+}
+
+void print_usage( const char *prog ){
+  fprintf( stderr, "Usage: %s [options] [scene files or patterns...]\n",
+           prog );
+  fprintf( stderr, "Renders ./bin/dump_file0.dat when no scene is given\n" );
+  fprintf( stderr, "  --threads N    number of render threads"
+                   " ( default: all cores )\n" );
+  fprintf( stderr, "  --seed N       seed for the random number generators\n" );
+  fprintf( stderr, "  --stream K     independent sample stream K of the seed,"
+                   " for renders\n"
+                   "                 that are merged later ( default: 0 )\n" );
+  fprintf( stderr, "  --spp N        samples per pixel ( default: 100, no cap"
+                   " with --time )\n" );
+  fprintf( stderr, "  --pass-spp N   samples per pixel and pass, enables"
+                   " progressive mode\n" );
+  fprintf( stderr, "  --height N     image height, the width follows the"
+                   " camera ( default: 300 )\n" );
+  fprintf( stderr, "  --max-depth N  max. bounces of a path, longer paths"
+                   " are cut\n"
+                   "                 ( default: 64 )\n" );
+  fprintf( stderr, "  --time S       time budget in seconds\n" );
+  fprintf( stderr, "  --write-interval S\n"
+                   "                 write the current image every S"
+                   " seconds\n" );
+  fprintf( stderr, "  --out PATH     output image"
+                   " ( default: ./images/out.png )\n" );
+  fprintf( stderr, "  --accum        also write the linear accumulation buffer"
+                   " to <image>.acc\n" );
+  fprintf( stderr, "  --adaptive     stop sampling pixels that have converged,"
+                   " --spp is the\n"
+                   "                 max. samples per pixel\n" );
+  fprintf( stderr, "  --min-spp N    min. samples per pixel with --adaptive"
+                   " ( default: 16 )\n" );
+  fprintf( stderr, "  --threshold T  relative error at which a pixel has"
+                   " converged\n"
+                   "                 ( default: 0.02 )\n" );
+  fprintf( stderr, "  --list FILE    render the scene files listed in FILE,"
+                   " one per line\n" );
+  fprintf( stderr, "  --out-dir DIR  output directory for batches"
+                   " ( default: ./images )\n" );
+  fprintf( stderr, "  --print-bvh    print the primitives and the BVH"
+                   " tree\n" );
+  fprintf( stderr, "  --bvh-stats FORMAT\n"
+                   "                 print the size, depth, SAH cost and"
+                   " memory of every\n"
+                   "                 scene's BVH as text or json\n" );
+  fprintf( stderr, "  --bvh BUILDER  sah, sbvh, lbvh or midpoint"
+                   " ( default: sah )\n" );
+  fprintf( stderr, "  --split-budget F\n"
+                   "                 references the SBVH may add by spatial"
+                   " splits, per\n"
+                   "                 primitive ( default: 1 )\n" );
+  fprintf( stderr, "  --bvh-width N  children per BVH node, 2, 4 ( SSE ) or"
+                   " 8 ( AVX2 ) ( default: 4 )\n" );
+  fprintf( stderr, "  --bvh-quantize store the child boxes of 4 or 8 wide"
+                   " nodes in 8 bits and\n"
+                   "                 drop the binary tree, about 4x less"
+                   " node memory\n" );
+  fprintf( stderr, "  --bvh-optimize N\n"
+                   "                 restructure the treelets of the built"
+                   " BVH N times\n"
+                   "                 ( default: 0 )\n" );
+  fprintf( stderr, "  --leaf-size N  max. primitives in a SAH or LBVH leaf"
+                   " ( default: 4 )\n" );
+  fprintf( stderr, "  --refit        refit the previous scene's BVH when"
+                   " the scenes of a\n"
+                   "                 batch only move their primitives\n" );
+  fprintf( stderr, "  --bvh-cache    keep the BVH of every scene file in"
+                   " <scene>.bvh and\n"
+                   "                 map it on the next run\n" );
+  fprintf( stderr, "  --coordinator ADDR\n"
+                   "                 render the scene on the workers that"
+                   " connect to ADDR,\n"
+                   "                 host:port or unix:path, with --spp"
+                   " samples per pixel\n" );
+  fprintf( stderr, "  --spawn N      start N local workers with --threads"
+                   " threads each\n" );
+  fprintf( stderr, "  --worker-timeout S\n"
+                   "                 reassign the tiles of a worker silent"
+                   " for S seconds, fail\n"
+                   "                 after S seconds without workers"
+                   " ( default: 60 )\n" );
+  fprintf( stderr, "  --worker ADDR  render tiles for the coordinator at"
+                   " ADDR\n" );
+  fprintf( stderr, "  --daemon ADDR  render the jobs submitted to ADDR\n" );
+  fprintf( stderr, "  --max-jobs N   jobs the daemon renders at the same"
+                   " time ( default: 4 )\n" );
+  fprintf( stderr, "  --scene-cache N\n"
+                   "                 loaded scenes the daemon keeps"
+                   " ( default: 8 )\n" );
+  fprintf( stderr, "  --submit ADDR  queue the scenes on the daemon at ADDR"
+                   " with --spp,\n"
+                   "                 --time, --height, --max-depth, --out"
+                   " and --priority\n" );
+  fprintf( stderr, "  --priority P   0 ( lowest ) to %d ( default: %d )\n",
+           THREAD_POOL_PRIORITIES - 1, DAEMON_DEFAULT_PRIORITY );
+  fprintf( stderr, "  --status ADDR  list the jobs of the daemon\n" );
+  fprintf( stderr, "  --cancel ADDR ID\n"
+                   "                 cancel a job of the daemon\n" );
+  fprintf( stderr, "  --checkpoint S save the render state to <image>.ckpt"
+                   " every S seconds\n"
+                   "                 and on SIGTERM/SIGINT\n" );
+  fprintf( stderr, "  --resume       continue from the checkpoints, the other"
+                   " options must\n"
+                   "                 be the ones of the interrupted run\n" );
+}
+
+// Adds the files matching the pattern, or the argument itself when
+// nothing matches so that a missing file is reported when it is loaded
+void add_scene_files( const char *pattern, char **&scenes ){
+#ifdef OS_LINUX_CPP
+  glob_t g;
+  if ( glob( pattern, 0, NULL, &g ) == 0 ){
+    for ( size_t i = 0; i < g.gl_pathc; i++ ){
+      array_push( scenes, strdup( g.gl_pathv[i] ) );
     }
+    globfree( &g );
+    return;
+  }
+  globfree( &g );
+#endif
+  array_push( scenes, strdup( pattern ) );
+}
+
+bool read_scene_list( const char *path, char **&scenes ){
+  FILE *fp = fopen( path, "r" );
+  if ( !fp ){
+    fprintf( stderr, "%s, ", path );
+    perror( "Unable to open scene list! " );
+    return false;
+  }
+  char line[1024];
+  while ( fgets( line, sizeof( line ), fp ) ){
+    line[ strcspn( line, "\r\n" ) ] = 0;
+    if ( line[0] == 0 || line[0] == '#' ) continue;
+    add_scene_files( line, scenes );
+  }
+  fclose( fp );
+  return true;
+}
+
+static const char *option_value( int argc, char **argv, int &i ){
+  if ( i + 1 >= argc ){
+    fprintf( stderr, "Missing value for option %s\n", argv[i] );
+    return NULL;
   }
-  array_free( object_data );
+  return argv[++i];
 }
 
+bool parse_options( int argc, char **argv, RenderOptions &opts ){
+  opts.thread_count = (int)std::thread::hardware_concurrency();
+  if ( opts.thread_count <= 0 ) opts.thread_count = 1;
+  opts.use_seed = false;
+  opts.seed = 0;
+  opts.samples = 0;
+  opts.pass_samples = 0;
+  opts.max_depth = 64;
+  opts.height = 300;
+  opts.quiet = false;
+  opts.time_budget = 0;
+  opts.write_interval = 0;
+  opts.output = "./images/out.png";
+  opts.adaptive = false;
+  opts.min_samples = 16;
+  opts.threshold = 0.02f;
+  opts.scenes = NULL;
+  opts.output_dir = "./images";
+  opts.print_bvh = false;
+  opts.bvh_stats = BVH_STATS_NONE;
+  opts.bvh = bvh_default_options();
+  opts.checkpoint_interval = 0;
+  opts.resume = false;
+  opts.write_accum = false;
+  opts.stream = 0;
+  opts.coordinator = NULL;
+  opts.worker = NULL;
+  opts.spawn = 0;
+  opts.worker_timeout = 60;
+  opts.daemon = NULL;
+  opts.max_jobs = 4;
+  opts.scene_cache = 8;
+  opts.client_request = CLIENT_NONE;
+  opts.client_addr = NULL;
+  opts.cancel_id = NULL;
+  opts.priority = DAEMON_DEFAULT_PRIORITY;
+
+  for ( int i = 1; i < argc; i++ ){
+    const char *arg = argv[i];
+    const char *val = NULL;
+    if ( !strcmp( arg, "--threads" ) || !strcmp( arg, "-t" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.thread_count = atoi( val );
+      if ( opts.thread_count <= 0 ){
+        fprintf( stderr, "Invalid thread count: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--seed" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.use_seed = true;
+      opts.seed = strtoull( val, NULL, 0 );
+    } else if ( !strcmp( arg, "--stream" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.stream = strtoull( val, NULL, 0 );
+    } else if ( !strcmp( arg, "--accum" ) ){
+      opts.write_accum = true;
+    } else if ( !strcmp( arg, "--spp" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.samples = strtoull( val, NULL, 0 );
+      if ( opts.samples == 0 ){
+        fprintf( stderr, "Invalid sample count: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--max-depth" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.max_depth = atoi( val );
+      if ( opts.max_depth <= 0 ){
+        fprintf( stderr, "Invalid depth: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--height" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.height = atoi( val );
+      if ( opts.height <= 0 ){
+        fprintf( stderr, "Invalid height: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--pass-spp" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.pass_samples = (uint32)atoi( val );
+      if ( opts.pass_samples == 0 ){
+        fprintf( stderr, "Invalid sample count: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--time" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.time_budget = atof( val );
+    } else if ( !strcmp( arg, "--write-interval" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.write_interval = atof( val );
+    } else if ( !strcmp( arg, "--out" ) || !strcmp( arg, "-o" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.output = val;
+    } else if ( !strcmp( arg, "--adaptive" ) ){
+      opts.adaptive = true;
+    } else if ( !strcmp( arg, "--min-spp" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.min_samples = (uint32)atoi( val );
+    } else if ( !strcmp( arg, "--threshold" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.threshold = atof( val );
+    } else if ( !strcmp( arg, "--list" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      if ( !read_scene_list( val, opts.scenes ) ) return false;
+    } else if ( !strcmp( arg, "--out-dir" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.output_dir = val;
+    } else if ( !strcmp( arg, "--print-bvh" ) ){
+      opts.print_bvh = true;
+    } else if ( !strcmp( arg, "--bvh-stats" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      if ( !strcmp( val, "text" ) ){
+        opts.bvh_stats = BVH_STATS_TEXT;
+      } else if ( !strcmp( val, "json" ) ){
+        opts.bvh_stats = BVH_STATS_JSON;
+      } else {
+        fprintf( stderr, "Unknown BVH stats format: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--bvh" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      if ( !strcmp( val, "sah" ) ){
+        opts.bvh.builder = BVH_BUILD_SAH;
+      } else if ( !strcmp( val, "midpoint" ) ){
+        opts.bvh.builder = BVH_BUILD_MIDPOINT;
+      } else if ( !strcmp( val, "lbvh" ) ){
+        opts.bvh.builder = BVH_BUILD_LBVH;
+      } else if ( !strcmp( val, "sbvh" ) ){
+        opts.bvh.builder = BVH_BUILD_SBVH;
+      } else {
+        fprintf( stderr, "Unknown BVH builder: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--bvh-width" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.bvh.width = atoi( val );
+      if ( opts.bvh.width != 2 && opts.bvh.width != 4 &&
+           opts.bvh.width != 8 )
+      {
+        fprintf( stderr, "Invalid BVH width: %s\n", val );
+        return false;
+      }
+      if ( opts.bvh.width > bvh_max_width() ){
+        fprintf( stderr, "No AVX2, using a 4 wide BVH\n" );
+        opts.bvh.width = bvh_max_width();
+      }
+    } else if ( !strcmp( arg, "--bvh-quantize" ) ){
+      opts.bvh.quantize = true;
+    } else if ( !strcmp( arg, "--bvh-optimize" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.bvh.optimize = atoi( val );
+      if ( opts.bvh.optimize < 0 ){
+        fprintf( stderr, "Invalid number of passes: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--refit" ) ){
+      opts.bvh.refit = true;
+    } else if ( !strcmp( arg, "--bvh-cache" ) ){
+      opts.bvh.cache = true;
+    } else if ( !strcmp( arg, "--split-budget" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.bvh.split_budget = atof( val );
+      if ( opts.bvh.split_budget < 0 ){
+        fprintf( stderr, "Invalid split budget: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--leaf-size" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.bvh.max_leaf_size = atoi( val );
+      if ( opts.bvh.max_leaf_size < 1 ){
+        fprintf( stderr, "Invalid leaf size: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--checkpoint" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.checkpoint_interval = atof( val );
+      if ( opts.checkpoint_interval <= 0 ){
+        fprintf( stderr, "Invalid checkpoint interval: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--resume" ) ){
+      opts.resume = true;
+    } else if ( !strcmp( arg, "--coordinator" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.coordinator = val;
+    } else if ( !strcmp( arg, "--worker" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.worker = val;
+    } else if ( !strcmp( arg, "--spawn" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.spawn = atoi( val );
+    } else if ( !strcmp( arg, "--worker-timeout" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.worker_timeout = atof( val );
+      if ( opts.worker_timeout <= 0 ){
+        fprintf( stderr, "Invalid timeout: %s\n", val );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--daemon" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.daemon = val;
+    } else if ( !strcmp( arg, "--max-jobs" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.max_jobs = MAX( atoi( val ), 1 );
+    } else if ( !strcmp( arg, "--scene-cache" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.scene_cache = MAX( atoi( val ), 0 );
+    } else if ( !strcmp( arg, "--submit" ) || !strcmp( arg, "--status" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.client_request = !strcmp( arg, "--submit" ) ? CLIENT_SUBMIT :
+                                                         CLIENT_STATUS;
+      opts.client_addr = val;
+    } else if ( !strcmp( arg, "--cancel" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.client_request = CLIENT_CANCEL;
+      opts.client_addr = val;
+      if ( !( opts.cancel_id = option_value( argc, argv, i ) ) ) return false;
+    } else if ( !strcmp( arg, "--priority" ) ){
+      if ( !( val = option_value( argc, argv, i ) ) ) return false;
+      opts.priority = atoi( val );
+      if ( opts.priority < 0 || opts.priority >= THREAD_POOL_PRIORITIES ){
+        fprintf( stderr, "Priorities go from 0 to %d\n",
+                 THREAD_POOL_PRIORITIES - 1 );
+        return false;
+      }
+    } else if ( !strcmp( arg, "--help" ) || !strcmp( arg, "-h" ) ){
+      return false;
+    } else if ( arg[0] != '-' ){
+      add_scene_files( arg, opts.scenes );
+    } else {
+      fprintf( stderr, "Unknown option: %s\n", arg );
+      return false;
+    }
+  }
+
+  if ( array_length( opts.scenes ) == 0 ){
+    add_scene_files( "./bin/dump_file0.dat", opts.scenes );
+  }
+
+  if ( opts.resume && opts.checkpoint_interval == 0 ){
+    fprintf( stderr, "--resume needs the --checkpoint interval\n" );
+    return false;
+  }
+
+  // Checkpoints are only written between passes, so they need a
+  // progressive render too
+  bool progressive = opts.pass_samples > 0 || opts.time_budget > 0 ||
+                     opts.write_interval > 0 || opts.adaptive ||
+                     opts.checkpoint_interval > 0;
+  if ( opts.samples == 0 ){
+    // With a time budget the render runs until the time is up
+    opts.samples = ( opts.time_budget > 0 ) ? UINT32_MAX : 100;
+  }
+  if ( opts.pass_samples == 0 ){
+    opts.pass_samples = progressive ? 4 : (uint32)MIN( opts.samples,
+                                                       (uint64)UINT32_MAX );
+  }
+  return true;
+}
 
+int main( int argc, char **argv ){
+  RenderOptions opts;
+  if ( !parse_options( argc, argv, opts ) ){
+    print_usage( argv[0] );
+    return 1;
+  }
+  uint scene_count = array_length( opts.scenes );
+  bool batch = scene_count > 1;
 
-int main( ){
-  prng_seed();
-  int ny = 300;
-  uint64 samples = 100;
+  // The seed goes into the checkpoints, a resumed render has to build
+  // the same perlin tables as the interrupted one
+  uint64 seed = opts.use_seed ? opts.seed : prng_random_seed();
+  if ( opts.resume && !opts.use_seed ){
+    for ( uint s = 0; s < scene_count; s++ ){
+      char output[1024], checkpoint[1040];
+      scene_output_path( output, sizeof( output ), opts, s, batch );
+      snprintf( checkpoint, sizeof( checkpoint ), "%s.ckpt", output );
+      if ( checkpoint_read_seed( checkpoint, seed ) ) break;
+    }
+  }
+  if ( opts.client_request != CLIENT_NONE ){
+    return daemon_client_main( opts );
+  }
+  if ( opts.worker ){
+    return worker_main( opts.worker, opts.thread_count, opts.bvh );
+  }
+  if ( opts.daemon ){
+    return daemon_main( opts, seed );
+  }
+  if ( opts.coordinator ){
+    return coordinator_main( opts, seed );
+  }
+  if ( opts.checkpoint_interval > 0 ){
+    signal( SIGTERM, render_stop_handler );
+    signal( SIGINT, render_stop_handler );
+  }
+  int ny = opts.height;
   Arena perlin_arena = new_arena();
-  Perlin perlin = create_perlin( &perlin_arena, 4.0f,256 );
+  Perlin perlin;
+  PRNG render_rng = render_init_random( seed, opts.stream, &perlin_arena,
+                                        perlin );
 //  Texture tex_perlin = create_texture_perlin( &perlin );
-  
-  Texture *textures = array_allocate( Texture, 100 );
-  Material *materials = array_allocate( Material, 100 );
-  
-  World world = {};
-  Camera camera;
 
+  // Everything below is created once and reused by all the scenes
+  // of a batch
+  ThreadPool *pool = thread_pool_create( opts.thread_count );
+  Scene *scene = scene_create( opts.bvh );
+  Framebuffer fb = {};
+  RenderJob job;
+  job.tiles = NULL;
+  job.fb = &fb;
 
-  v3 lf = { 0,1,5.5 };
-  v3 lat = { 0,1,-1 };
-  float f = HMM_LengthVec3( lat - lf );
-  world.sph_cap = 20;
-  world.spheres = ( Sphere * )malloc(
-                  sizeof(Sphere )* world.sph_cap );
-
-  world.plane_cap = 4;
-  world.planes = ( Plane * )malloc(
-                  sizeof(Plane)* world.plane_cap );
-
-  world.aa_rect_cap= 50;
-  world.aa_rects = ( AARect* )malloc(
-                  sizeof(AARect)* world.rect_cap);
-
-  world.rect_cap= 50;
-  world.rectangles = ( Rectangle * )malloc( 
-                  sizeof(Rectangle) * world.rect_cap );
-  assert( world.spheres );
-  float aspect_ratio = 0;
-  world_get_from_file("./bin/dump_file0.dat",
-      textures,
-      materials,
-      &perlin,
-      world,
-      camera,
-      &aspect_ratio );
-  int nx = (int)( ny * aspect_ratio );
-  float total_pixels = nx * ny; 
+  int failed = 0;
 #if 0
   AARect rect1(
       AARect::PLANE_XY,
@@ -1244,56 +6357,83 @@ int main( ){
    world_add_rect( world, top );
    world_add_rect( world, bottom);
 #endif
-  std::vector<PrimInfo> ordered_prims;
-  Arena bvh_arena = new_arena();
-  BVHNode *tree = create_bvh_tree( &bvh_arena, world, ordered_prims );
-#if 1
-  for ( size_t i = 0; i < ordered_prims.size(); i++ ){
-    fprintf(stdout,"Index %d\n", i );
-    print_priminfo( &ordered_prims[i] );
-    fprintf(stdout,"\n========================================\n");
-  }
-  bvh_tree_print( tree );
-#endif
-//  Ray r = camera.get_ray( 0.5f, 0.5f );
-//  v3 color = get_ray_color( tree,r, 0, ordered_prims );
-#if 1
-  uint8 *buff = ( uint8 *)malloc( 3 * nx * ny * sizeof( uint8 ) );
-  uint8 *start = buff;
-  uint64 pixel_completed = 0;
-  uint pixel_five_percent = (uint)( 0.05 * total_pixels ); 
-  int count = 0;
-  for ( int j = ny - 1; j >= 0; j-- ){
-    for ( int i = 0; i < nx; i++ ){
-      v3 color = { 0.0f, 0.0f, 0.0f };
-      for ( uint64 k = 0; k < samples ; k++ ){
-        float s1 = ( i + prng_float() )/(float)nx;
-        float s2 = ( j + prng_float() )/(float)ny;
-        Ray r = camera.get_ray( s1, s2 );
-        color = color + get_ray_color( tree,r, 0, ordered_prims );
-      }
-      color = color / samples;
-      color = { HMM_SquareRootF( color[0] ),
-                HMM_SquareRootF( color[1] ),
-                HMM_SquareRootF( color[2] ) };
-
-      int ir = (int)(255.99 * CLAMP( color[0], 0.0f, 1.0f ) );
-      int ig = (int)(255.99 * CLAMP( color[1], 0.0f, 1.0f ) );
-      int ib = (int)(255.99 * CLAMP( color[2], 0.0f, 1.0f ) );
-      
-      *start++ = ir & 0xff;
-      *start++ = ig & 0xff;
-      *start++ = ib & 0xff;
-      pixel_completed++;
-      if ( pixel_completed >= pixel_five_percent ){
-        count++;
-        pixel_completed = 0;
-        printf("Ray tracing %d percent completed\n", count * 5 );
+  for ( uint s = 0; s < scene_count && !render_stop_requested; s++ ){
+    const char *path = opts.scenes[s];
+    double start = get_time();
+    if ( !scene_load( *scene, path, &perlin, pool ) ){
+      failed++;
+      continue;
+    }
+    double load_time = get_time() - start;
+    if ( opts.print_bvh ){
+      std::vector<PrimInfo> &ordered_prims = scene->ordered_prims;
+      for ( size_t i = 0; i < ordered_prims.size(); i++ ){
+        fprintf(stdout,"Index %d\n", (int)i );
+        print_priminfo( &ordered_prims[i] );
+        fprintf(stdout,"\n========================================\n");
+      }
+      if ( scene->bvh.nodes ) bvh_tree_print( scene->bvh.nodes, 0 );
+    }
+    if ( opts.bvh_stats != BVH_STATS_NONE ){
+      BVHStats stats = bvh_compute_stats( scene->bvh,
+                                          scene->ordered_prims.size() );
+      bvh_stats_print( stdout, opts.bvh_stats, path, stats,
+                       scene->bvh_options, scene->bvh.width );
+    }
+
+    // Every scene starts from the same streams, so an image does not
+    // depend on its position in the batch
+    render_job_setup( job, scene, ny, render_rng );
+    printf( "Rendering %s, %dx%d with %d threads\n",
+            path, job.nx, job.ny, opts.thread_count );
+
+    char output[1024], checkpoint[1040];
+    scene_output_path( output, sizeof( output ), opts, s, batch );
+    snprintf( checkpoint, sizeof( checkpoint ), "%s.ckpt", output );
+    if ( opts.checkpoint_interval > 0 &&
+         !checkpoint_scene_hash( path, job.scene_hash ) )
+    {
+      failed++;
+      continue;
+    }
+    if ( opts.resume ){
+      FILE *fp = fopen( checkpoint, "rb" );
+      if ( fp ){
+        fclose( fp );
+        if ( !checkpoint_read( checkpoint, job, opts ) ){
+          failed++;
+          continue;
+        }
+        printf( "Resuming from %s, %" PRIu64 " spp done\n",
+                checkpoint, (uint64)job.samples_done );
+      } else {
+        printf( "No checkpoint %s, starting from the beginning\n",
+                checkpoint );
       }
     }
+    bool complete = render_progressive(
+        pool, job, opts, output,
+        opts.checkpoint_interval > 0 ? checkpoint : NULL, seed );
+
+    if ( framebuffer_write_png( fb, output ) && complete &&
+         opts.checkpoint_interval > 0 )
+    {
+      remove( checkpoint );
+    }
+    if ( opts.write_accum ){
+      char accum[1040];
+      snprintf( accum, sizeof( accum ), "%s.acc", output );
+      framebuffer_write_accum( fb, accum );
+    }
+    printf( "Wrote %s, load %.3f s ( BVH %s %.6f s ), total %.2f s\n",
+            output, load_time, bvh_source_names[ scene->bvh_source ],
+            scene->bvh_build_time, get_time() - start );
   }
-  
-  stbi_write_png( "./images/out.png", nx, ny, 3, buff,3 * nx );
-#endif
-  return 0;
+
+  thread_pool_destroy( pool );
+  scene_destroy( scene );
+  framebuffer_free( fb );
+  array_free( job.tiles );
+  arena_free( &perlin_arena );
+  return failed ? 1 : 0;
 }
@@ -2529,7 +2529,7 @@ void convert_texture_to_dump(
   }
 }
 
-void world_dump_rect_data( const World &w, DumpObjectData *store ){
+void world_dump_rect_data( const World &w, DumpObjectData *&store ){
   Rectangle *rects = w.rects;
   for ( uint i = 0; i < array_length( rects ); i++ ){
     Material &material = w.rect_materials[i];
@@ -2550,7 +2550,7 @@ void world_dump_rect_data( const World &w, DumpObjectData *store ){
   }
 }
 
-void world_dump_sphere_data( const World &w, DumpObjectData *store ){
+void world_dump_sphere_data( const World &w, DumpObjectData *&store ){
   Sphere *spheres= w.spheres;
   for ( uint i = 0; i < array_length( spheres ); i++ ){
     Material &material = w.sphere_materials[i];
@@ -2581,58 +2581,102 @@ void apply_cube_transform_to_rect( Rectangle &r, Cube &cube ){
 }
 
 
-void world_dump_cube_data( const World &w, DumpObjectData *store ){
-  for ( uint i = 0; i < array_length( w.cubes ); i++ ){
-    Rectangle rects[6];
-    generate_cube_rects( rects, w.cubes[i].length );
-    Material &material = w.cube_materials[i];
-    Texture &texture = material.texture;
+// Faces of a cube of unit size in its own space, with its material.
+// The records are zeroed with memset() and filled in place, shapes
+// are compared byte by byte and = {} may leave the padding as it was.
+static void cube_face_data( DumpObjectData *faces, const Material &material ){
+  Rectangle rects[6];
+  generate_cube_rects( rects, 1.0f );
+  const Texture &texture = material.texture;
+  for ( uint f = 0; f < 6; f++ ){
+    DumpObjectData &data = faces[f];
+    memset( &data, 0, sizeof( data ) );
+    data.type = DumpObjectData::RECTANGLE;
+    data.object_data.p0 = rects[f].p0;
+    data.object_data.s1 = rects[f].s1;
+    data.object_data.s2 = rects[f].s2;
+    data.object_data.n =  rects[f].n;
+    data.object_data.l1=  rects[f].l1;
+    data.object_data.l2=  rects[f].l2;
 
-    for ( uint faces = 0; faces < 6; faces++ ){
-      DumpObjectData data;
-      data.type = DumpObjectData::RECTANGLE;
-  // Apply cube transformation to the rectangle
-      apply_cube_transform_to_rect(rects[faces], w.cubes[i] );
+    convert_material_to_dump( data, material );
+    switch ( texture.type ){
+      case Texture::COLOR:
+        data.texture_type= DumpObjectData::TEXTURE_PLAIN_COLOR;
+        data.texture_data.color = texture.face_colors[f];
+        break;
+      case Texture::MARBLE:
+        data.texture_type = DumpObjectData::TEXTURE_MARBLE;
+        data.texture_data.marble_color = texture.face_colors[f];
+        break;
+      case Texture::CHECKER:
+        data.texture_type = DumpObjectData::TEXTURE_CHECKER;
+        data.texture_data.checker_color[0] = texture.face_colors[f];
+        data.texture_data.checker_color[1] = v3{0.0f,0.0f,0.0f};
+        data.texture_data.freq = 2.0f;
+        break;
+    }
+  }
+}
 
-      data.object_data.p0 = rects[faces].p0;
-      data.object_data.s1 = rects[faces].s1;
-      data.object_data.s2 = rects[faces].s2;
-      data.object_data.n =  rects[faces].n;
-      data.object_data.l1=  rects[faces].l1;
-      data.object_data.l2=  rects[faces].l2;
+// Cubes that only differ in position, orientation and size share one
+// shape of unit size, each cube is an instance of it
+void world_dump_cube_data( const World &w, DumpObjectData *&store ){
+  uint cube_count = array_length( w.cubes );
+  if ( !cube_count ) return;
+  DumpObjectData *shapes = array_allocate( DumpObjectData, 6 );
+  DumpObjectData *instances = array_allocate( DumpObjectData, cube_count );
+  for ( uint i = 0; i < cube_count; i++ ){
+    const Cube &cube = w.cubes[i];
+    DumpObjectData faces[6];
+    cube_face_data( faces, w.cube_materials[i] );
+
+    uint shape_count = array_length( shapes ) / 6;
+    uint shape = 0;
+    while ( shape < shape_count &&
+            memcmp( shapes + 6 * shape, faces, sizeof( faces ) ) ){
+      shape++;
+    }
+    if ( shape == shape_count ){
+      for ( uint f = 0; f < 6; f++ ){
+        array_push( shapes, faces[f] );
+      }
+      // copied byte by byte, padding included, for the comparison above
+      memcpy( shapes + 6 * shape, faces, sizeof( faces ) );
+    }
 
+    q4 quat = HMM_NormalizeQuaternion( cube.orientation );
+    DumpObjectData data = {};
+    data.type = DumpObjectData::INSTANCE;
+    data.object_data.shape_index = shape;
+    data.object_data.position = cube.pos;
+    data.object_data.orientation[0] = quat.X;
+    data.object_data.orientation[1] = quat.Y;
+    data.object_data.orientation[2] = quat.Z;
+    data.object_data.orientation[3] = quat.W;
+    data.object_data.scale = cube.length;
+    array_push( instances, data );
+  }
 
-      convert_material_to_dump( data, material );
-      switch ( texture.type ){
-        case Texture::COLOR:
-          printf("Dumping color texture with value %d\n",
-              DumpObjectData::TEXTURE_PLAIN_COLOR );
-          data.texture_type= DumpObjectData::TEXTURE_PLAIN_COLOR;
-          data.texture_data.color = texture.face_colors[faces];
-          break;
-        case Texture::MARBLE:
-          printf("Dumping marble texture with value %d\n",
-              DumpObjectData::TEXTURE_MARBLE );
-          data.texture_type = DumpObjectData::TEXTURE_MARBLE;
-          data.texture_data.marble_color = texture.face_colors[faces];
-          break;
-        case Texture::CHECKER:
-          printf("Dumping checker texture with value %d\n",
-              DumpObjectData::TEXTURE_CHECKER );
-          data.texture_type = DumpObjectData::TEXTURE_CHECKER;
-          data.texture_data.checker_color[0] = texture.face_colors[faces];
-          data.texture_data.checker_color[1] = v3{0.0f,0.0f,0.0f};
-          data.texture_data.freq = 2.0f;
-          break;
-      }
-      array_push( store, data );
+  for ( uint i = 0; i < array_length( shapes ); i += 6 ){
+    DumpObjectData data = {};
+    data.type = DumpObjectData::SHAPE;
+    data.object_data.shape_objects = 6;
+    array_push( store, data );
+    for ( uint f = 0; f < 6; f++ ){
+      array_push( store, shapes[ i + f ] );
     }
   }
+  for ( uint i = 0; i < array_length( instances ); i++ ){
+    array_push( store, instances[i] );
+  }
+  array_free( shapes );
+  array_free( instances );
 }
 
 void world_dump_light_rect_data(
     const World &w,
-    DumpObjectData *store )
+    DumpObjectData *&store )
 {
   Rectangle *rects = w.light_rects;
   for ( uint i = 0; i < array_length( rects ); i++ ){
@@ -2652,7 +2696,7 @@ void world_dump_light_rect_data(
 
 void world_dump_light_sphere_data(
     const World &w,
-    DumpObjectData *store )
+    DumpObjectData *&store )
 {
   Sphere *spheres= w.light_spheres;
   for ( uint i = 0; i < array_length( spheres ); i++ ){
@@ -2669,7 +2713,7 @@ void world_dump_light_sphere_data(
 
 void world_dump_light_cube_data(
     const World &w,
-    DumpObjectData *store )
+    DumpObjectData *&store )
 {
   Cube *cubes = w.light_cubes;
   for ( uint i = 0; i < array_length( cubes ); i++ ){